@@ -7,23 +7,44 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /*** defines ***/
 
 #define SEX_VERSION "0.0.1"
 #define SEX_TAB_STOP 8
 #define SEX_QUIT_TIMES 3
+#define SEX_STREAM_CHUNK (1 << 20)
+#define SEX_COMPLETIONS 8
+#define SEX_WRAP_WIDTHS 4 // widths a buffer keeps a wrap index for, one per differing view
+#define SEX_PAGER_STEP 4096         // lines between checkpoints of the -R viewer's index
+#define SEX_PAGER_WINDOW (16 << 20) // bytes of the file the -R viewer maps at a time
+#define SEX_INDENT 4 // spaces per open bracket when the file does not indent with tabs
+#define SEX_HISTORY 100             // searches kept, across sessions
+#define SEX_SESSION_SAMPLE (1 << 16) // bytes at each end of a -R file that its session is keyed on
+#define SEX_SESSION_MAGIC "SEXSES1"
 
 #define CTRL_KEY(k) ((k)&0x1f)
 
@@ -41,6 +62,20 @@ enum editorKey
   PAGE_DOWN
 };
 
+enum editorUndo
+{
+  UNDO_ROW,    // the row at at changed
+  UNDO_INSERT, // n rows were inserted at at
+  UNDO_DELETE  // n rows were deleted at at
+};
+
+enum editorGutter
+{
+  GUTTER_OFF = 0,
+  GUTTER_ABSOLUTE,
+  GUTTER_RELATIVE // distance from the cursor line, which shows its own number
+};
+
 enum editorHighlight
 {
   HL_NORMAL = 0,
@@ -56,6 +91,15 @@ enum editorHighlight
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
+// byte classes compiled into editorSyntax.cls
+#define CLS_SEP (1 << 0)
+#define CLS_NUM (1 << 1) // digit or '.'
+#define CLS_QUOTE (1 << 2)
+#define CLS_SCS (1 << 3) // may start a single line comment
+#define CLS_MCS (1 << 4) // may start a multiline comment
+#define CLS_MCE (1 << 5) // may end a multiline comment
+#define CLS_KW (1 << 6)  // may start a keyword
+
 /*** data ***/
 
 struct editorSyntax
@@ -67,6 +111,51 @@ struct editorSyntax
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  char *quotes;
+  char **interpreters; // matched against a #! line
+};
+
+struct editorKeyword
+{
+  unsigned int word; // offset from the start of the syntaxTable
+  int len;
+  unsigned char hl;
+};
+
+// Compiled form of an editorSyntax. It holds offsets from its own start
+// instead of pointers so it can be used straight out of the mmap'd cache.
+struct syntaxTable
+{
+  unsigned int size;
+  unsigned int filetype, scs, mcs, mce; // string offsets, 0 if unset
+  int scs_len, mcs_len, mce_len;
+  int flags;
+  int wordsafe; // no identifier byte can start a comment or string
+  unsigned char cls[256];
+  int kwstart[257];          // kw[kwstart[c]..kwstart[c + 1]] start with byte c
+  struct editorKeyword kw[]; // grouped by first byte, followed by the strings
+};
+
+#define SYNSTR(tab, off) ((const char *)(tab) + (off))
+
+struct syntaxSlot
+{
+  unsigned int key; // offset of a NUL terminated key, 0 for an empty slot
+  int syn;
+};
+
+// Header of the syntax cache image, every offset is from its start
+struct syntaxCache
+{
+  char magic[8];
+  unsigned long long fingerprint;
+  unsigned int size;
+  unsigned int nsyntax;
+  unsigned int tables;    // unsigned int[nsyntax] of syntaxTable offsets
+  unsigned int nslots;    // power of two
+  unsigned int slots;     // ".ext", "ft:name" and "#!interpreter" keys
+  unsigned int npatterns; // filematch entries that are not extensions
+  unsigned int patterns;
 };
 
 typedef struct erow
@@ -78,23 +167,239 @@ typedef struct erow
   char *render;
   unsigned char *hl;
   int hl_open_comment;
+  int tabs;          // tabs in chars, with cw == NULL the row maps byte for byte
+  unsigned char *cw; // display width of the character at each render byte, NULL if all ASCII
+  int wrapw;         // width that nwrap and wrap were computed for, 0 if stale
+  int nwrap;         // screen lines the row takes when soft wrapped
+  int *wrap;         // where screen lines after the first start, only for rows with cw
+  int bclose, bopen; // brackets left unmatched in the row, closing ones come first
+  int *refs;         // holders of chars while shared with the clipboard, NULL if owned
+  int hlstale;       // highlight waits for editorFlushSyntax, see editorRowSyntax
 } erow;
 
+// Bracket summary of a span of rows: bclose closers that match something
+// before the span, then bopen openers still waiting for their closer
+struct bracketSpan
+{
+  int bclose, bopen;
+};
+
+// Prefix trie of the identifiers in a buffer, counted per occurrence.
+// best is the highest count in a node's subtree, for best-first search.
+struct trieNode
+{
+  int parent, child, next; // indexes into nodes, 0 is the root and means none
+  int count, best;
+  unsigned char c;
+};
+
+struct trieEdge
+{
+  int parent, child; // child 0 marks a free slot
+  unsigned char c;
+};
+
+struct wordIndex
+{
+  struct trieNode *nodes;
+  int numnodes, cap;
+  struct trieEdge *edges; // open addressing on (parent, c), a step down touches one slot
+  int edgemask;
+  int built; // rows are only counted once completion has been asked for
+};
+
+// Screen lines of each row when wrapped at width, with a Fenwick tree over
+// them to go between rows and screen lines in O(log n)
+struct wrapIndex
+{
+  int width; // 0 for an unused slot
+  int n;     // rows, kept in step with the buffer's by editorWrapSplice
+  int cap;
+  int *nwrap; // of row r
+  int *tree;  // 1-based
+  unsigned int used; // when it was last asked for, the oldest goes first
+};
+
+// Compressed files are read and written through the codec's own program
+struct editorCodec
+{
+  const char *ext;
+  const char *prog;
+};
+
+// Header of a session file, what was last seen of a file when sex quit. What
+// follows the position is only used while size, mtime and hash still match.
+struct editorSession
+{
+  char magic[8];
+  unsigned int len; // bytes in the session file
+  off_t size;
+  struct timespec mtime;
+  unsigned long long hash;   // of the text, for -R of its first and last SEX_SESSION_SAMPLE bytes
+  unsigned long long syntax; // hash of the syntax table the comment states are for
+  int cx, cy, rowoff, coloff;
+  int numrows;           // rows with a comment state, a bit each from offset comments
+  unsigned int comments;
+  long top; // the -R viewer's, its first line at topoff
+  off_t topoff;
+  long nmarks, lines; // the -R viewer's index, nmarks offsets from offset marks
+  unsigned int marks;
+};
+
+struct editorBuffer
+{
+  int numrows;
+  int rowcap;
+  erow *row;
+  int dirty;
+  char *filename;
+  off_t fileoff; // bytes of the file consumed by editorOpen and follow mode
+  int partial;   // last row has no trailing newline yet
+  int readonly;
+  int follow;
+  int follow_fd;
+  int watch;                  // inotify watch on filename, -1 if none
+  int watch_event;            // the watch fired since the last idle tick
+  struct timespec disk_mtime; // what the file looked like when last read or written
+  off_t disk_size;
+  unsigned long long disk_hash;
+  int disk_changed;
+  int stream_fd;       // pipe or file being read into the buffer, e.g. `cmd | sex -`
+  pid_t stream_pid;    // decompressor writing into stream_fd, 0 if none
+  int stream_file;     // stream_fd is filename being loaded in the background
+  size_t stream_bytes; // bytes received from stream_fd so far
+  unsigned long long stream_hash;
+  const struct syntaxTable *syntax;
+  const struct editorCodec *codec; // filename is compressed, read and saved through it
+  unsigned int version;       // bumped whenever rows or highlight change
+  int jump;                   // line to go to once loaded, 0 for none
+  int mark;                   // Ctrl-Space set markcx, markcy as the other end of a region
+  int markcx, markcy;
+  struct wrapIndex wraps[SEX_WRAP_WIDTHS]; // one per width the buffer is wrapped at
+  struct bracketSpan *brtree; // segment tree of the row bracket summaries, leaves from brsize
+  int brsize;                 // leaves in brtree, a power of two
+  int brok;                   // brtree matches the rows, cleared when rows come or go
+  int hlfrom, hlto;           // rows that may have a stale highlight, none if hlfrom > hlto
+  struct undoEntry *undo;
+  int numundo, undocap;
+  struct wordIndex words;
+  int cx, cy, rowoff, coloff; // view position while the buffer is not shown
+  const struct editorSession *session; // mapped while the file loads, see editorSessionOpen
+  const unsigned char *comments;       // its comment states, NULL if the file changed since
+  int hlidle; // rows from here on may wait for a highlight from the idle loop, -1 if none do
+};
+
+// A line of the clipboard. Whole rows are shared with the rows they were
+// copied from and pasted to, see editorRowOwn.
+struct clipLine
+{
+  char *chars;
+  int size;
+  int *refs;
+};
+
+// An edit as it can be taken back. The lines a row or rows held are shared
+// with them like the clipboard's, so journaling a big delete copies nothing.
+struct undoEntry
+{
+  int type;  // see editorUndo
+  int group; // entries undone together: one key, a run of typing or a macro run
+  int at, n;
+  struct clipLine *lines; // for UNDO_ROW and UNDO_DELETE
+  int cx, cy;             // cursor when the group began
+};
+
+// Extra cursors made by C-x c, a keystroke applies at all of them
+struct editorCursor
+{
+  int cx, cy;
+};
+
+// What a screen line of the gutter shows, formatted once per number
+struct gutterCell
+{
+  int num; // 0 for a blank cell, -1 if text is stale
+  int drawn;
+  char text[12];
+};
+
+// A window onto a buffer. Views of the same buffer share its rows, so each
+// row is rendered and highlighted once however many views show it.
+struct editorView
+{
+  struct editorBuffer *buf;
+  int cx, cy, rx, rowoff, coloff;
+  int wrap, wrapoff;
+  int top, left, rows, cols; // text area on screen, the status bar is the line below
+  unsigned long long drawn;  // what the text area shows, see editorViewSignature
+  unsigned long long drawn_status;
+  int gutter; // columns of line numbers left of the text area, part of cols
+  struct gutterCell *gutter_cells;
+  int gutter_lines; // entries in gutter_cells, the rows they were made for
+};
+
+// The -R viewer shows a file without reading it into rows. Lines are found
+// from a checkpoint every SEX_PAGER_STEP lines, reading a mapped window.
+struct editorPager
+{
+  int fd;
+  char *filename;
+  off_t size;
+  char *map; // maplen bytes of the file from mapoff
+  off_t mapoff;
+  size_t maplen;
+  off_t *marks; // offset of line j * SEX_PAGER_STEP
+  long nmarks;
+  long lines; // -1 until the index reached the end of the file
+  long top;   // first line on screen
+  off_t topoff;
+  int coloff;
+  char *query; // last search, repeated with n and highlighted
+};
+
 struct editorConfig
 {
   int cx, cy;
   int rx;
   int rowoff;
   int coloff;
-  int screenrows;
+  int wrap;    // soft wrap long rows instead of scrolling sideways
+  int wrapoff; // screen lines of row rowoff above the view when wrapping
+  int linenumbers; // what the gutter shows, see editorGutter
+  int screenrows; // size of the current view
   int screencols;
-  int numrows;
-  erow *row;
-  int dirty;
-  char *filename;
+  int termrows;
+  int termcols;
+  struct editorView *views;
+  int numviews;
+  int view;    // index of the current view, whose position is in cx, cy, ...
+  int repaint; // the whole screen has to be drawn again
+  erow *match_row[2]; // bracket under the cursor and its match, highlighted while drawing
+  int match_rx[2];
+  struct editorBuffer *buf; // the buffer being shown and edited
+  struct editorCursor *cursors; // one per row sorted by cy, including cx, cy
+  int numcursors;
+  struct clipLine *clip; // cut or copied text, a line per row
+  int numclip;
+  int journal;           // edits go to the undo journal, set while handling keys
+  int undogroup;         // group of the key being handled
+  int undocx, undocy;    // cursor when the group began
+  int *macro;            // keys recorded with C-x ( and C-x )
+  int macrolen, macrocap;
+  int recording;
+  int replaying; // a macro runs, refresh and highlighting wait until it ends
+  int replaypos; // next macro key for editorReadKey, -1 if none
+  struct editorBuffer **buffers;
+  int numbuffers;
+  volatile sig_atomic_t resized; // set by SIGWINCH, handled in editorReadKey
+  int streams;  // buffers with a stream_fd, the idle loop polls while > 0
+  int stdin_fd; // stdin when it was a pipe, see enableRawMode
+  int inotify_fd;
+  struct editorPager *pager; // -R, drawn instead of the views
+  char **history; // searches, oldest first, stepped through with C-p and C-n
+  int numhistory;
   char statusmsg[80];
   time_t statusmsg_time;
-  struct editorSyntax *syntax;
   struct termios orig_termios;
 };
 
@@ -115,16 +420,165 @@ struct editorSyntax HLDB[] = {
      C_HL_extensions,
      C_HL_keywords,
      "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+     "\"'", NULL},
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+#define SEX_CACHE_MAGIC "SEXSYN2"
+
+// Compiled HLDB plus the syntax config directory, mmap'd from the cache
+struct syntaxCache *SC;
+
 /*** prototypes ***/
 
+void die(const char *s);
+int editorIdle();
+void editorResize();
+int editorReadTerminalKey();
+int editorCheckWritable();
+void editorFlushSyntax();
+void editorHighlightIdle(long long deadline);
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+void editorProcessKeypress();
+void editorStreamStart(int fd, int file);
+void editorPagerRefresh();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPromptHistory(char *prompt, void (*callback)(char *, int), int history);
+
+/*** clock ***/
+
+long long clockNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*** hashing ***/
+
+unsigned long long editorHash(const char *s, size_t len, unsigned long long h)
+{
+  for (size_t j = 0; j < len; j++)
+  {
+    h ^= (unsigned char)s[j];
+    h *= 0x100000001b3ULL; // FNV-1a
+  }
+  return h;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+/*** profiling ***/
+
+#ifdef SEX_PROFILE
+
+#define SEX_PROF_FRAMES 128
+
+enum editorPhase
+{
+  PH_INPUT = 0,
+  PH_SYNTAX,
+  PH_DRAW,
+  PH_WRITE,
+  PH_COUNT
+};
+
+struct editorProfile
+{
+  int show;
+  long long phase[PH_COUNT]; // nanoseconds spent in each phase this frame
+  long long last[PH_COUNT];  // same, for the last completed frame
+  long long frames[SEX_PROF_FRAMES];
+  int nframes;
+  long long hlbytes, last_hlbytes;
+  int written;
+};
+
+struct editorProfile P;
+
+#define PROF_BEGIN(ph) long long prof_start_##ph = clockNs()
+#define PROF_END(ph) P.phase[ph] += clockNs() - prof_start_##ph
+#define PROF_COUNT(field, n) P.field += (n)
+
+#else
+
+#define PROF_BEGIN(ph)
+#define PROF_END(ph)
+#define PROF_COUNT(field, n)
+
+#endif
+
+/*** tracing ***/
+
+#define SEX_TRACE_EVENTS 65536
+
+struct traceEvent
+{
+  const char *name;
+  long long ts;
+  long long dur;
+};
+
+// The editor is single threaded, so the one ring below is the per-thread
+// buffer: it is only ever written by the main loop and needs no locking.
+struct editorTrace
+{
+  FILE *fp;
+  long long epoch;
+  unsigned long long head; // total number of events recorded
+  struct traceEvent ev[SEX_TRACE_EVENTS];
+};
+
+struct editorTrace T;
+
+void traceRecord(const char *name, long long start)
+{
+  struct traceEvent *ev = &T.ev[T.head++ % SEX_TRACE_EVENTS];
+  ev->name = name;
+  ev->ts = start;
+  ev->dur = clockNs() - start;
+}
+
+void traceFlush()
+{
+  if (!T.fp)
+    return;
+
+  unsigned long long first = T.head > SEX_TRACE_EVENTS ? T.head - SEX_TRACE_EVENTS : 0;
+  fprintf(T.fp, "{\"traceEvents\":[");
+  for (unsigned long long j = first; j < T.head; j++)
+  {
+    struct traceEvent *ev = &T.ev[j % SEX_TRACE_EVENTS];
+    fprintf(T.fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,"
+                  "\"ts\":%.3f,\"dur\":%.3f}",
+            j == first ? "" : ",", ev->name, (int)getpid(),
+            (ev->ts - T.epoch) / 1e3, ev->dur / 1e3);
+  }
+  fprintf(T.fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  fclose(T.fp);
+  T.fp = NULL;
+}
+
+void traceOpen(const char *filename)
+{
+  T.fp = fopen(filename, "w");
+  if (!T.fp)
+    die("fopen");
+  T.epoch = clockNs();
+  T.head = 0;
+  atexit(traceFlush);
+}
+
+#define TRACE_BEGIN(name) long long trace_##name = T.fp ? clockNs() : 0
+#define TRACE_END(name)                \
+  do                                   \
+  {                                    \
+    if (T.fp)                          \
+      traceRecord(#name, trace_##name); \
+  } while (0)
 
 /*** terminal ***/
 
@@ -145,6 +599,15 @@ void disableRawMode()
 
 void enableRawMode()
 {
+  if (!isatty(STDIN_FILENO)) // stdin is a pipe: keep it for reading and take keys from the terminal
+  {
+    E.stdin_fd = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+    if (E.stdin_fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1)
+      die("/dev/tty");
+    close(tty);
+  }
+
   if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) // gets param associated with terminal and stores them in termios structure
     die("tcgetattr");                                 // returns error message 'tcgetattr'
   atexit(disableRawMode);                             // called when the program ends
@@ -166,15 +629,49 @@ void enableRawMode()
     die("tcsetattr");
 }
 
-int editorReadKey()
+void handleSigwinch(int sig)
+{
+  (void)sig;
+  E.resized = 1;
+}
+
+// No SA_RESTART, so a resize interrupts the blocking read in editorReadKey
+void editorWatchResize()
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handleSigwinch;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGWINCH, &sa, NULL) == -1)
+    die("sigaction");
+}
+
+void editorSetReadTimeout(int vtime)
+{
+  struct termios raw;
+  if (tcgetattr(STDIN_FILENO, &raw) == -1)
+    die("tcgetattr");
+  raw.c_cc[VTIME] = vtime;
+  if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) == -1)
+    die("tcsetattr");
+}
+
+int editorReadTerminalKey()
 {
   int nread;
   char c;
   // tests if no error in c buffer
   while ((nread = read(STDIN_FILENO, &c, 1)) != 1) // returns 1 if a byte is read, 0 if EOF
   {
-    if (nread == -1 && errno != EAGAIN) // if nread returns -1, it's an error, errno is set to indicate the error
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) // if nread returns -1, it's an error, errno is set to indicate the error
       die("read");
+    if (E.resized)
+    {
+      editorResize();
+      editorRefreshScreen();
+    }
+    else if (editorIdle()) // no key within VTIME, do background work
+      editorRefreshScreen();
   }
 
   if (c == '\x1b') // if character is the escape character
@@ -251,6 +748,24 @@ int editorReadKey()
   }
 }
 
+// Next key from the terminal, or from the macro being run
+int editorReadKey()
+{
+  if (E.replaypos >= 0 && E.replaypos < E.macrolen)
+    return E.macro[E.replaypos++];
+  int c = editorReadTerminalKey();
+  if (E.recording)
+  {
+    if (E.macrolen == E.macrocap)
+    {
+      E.macrocap = E.macrocap ? E.macrocap * 2 : 64;
+      E.macro = realloc(E.macro, sizeof(int) * E.macrocap);
+    }
+    E.macro[E.macrolen++] = c;
+  }
+  return c;
+}
+
 int getCursorPosition(int *rows, int *cols)
 {
   char buf[32];
@@ -295,152 +810,511 @@ int getWindowSize(int *rows, int *cols)
   }
 }
 
-/*** syntax highlighting ***/
+/*** append buffer ***/
 
-int is_separator(int c)
+struct abuf
 {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
-}
+  char *b;
+  int len;
+};
 
-void editorUpdateSyntax(erow *row)
+#define ABUF_INIT \
+  {               \
+    NULL, 0       \
+  }
+
+void abAppend(struct abuf *ab, const char *s, int len)
 {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
+  char *new = realloc(ab->b, ab->len + len);
 
-  if (E.syntax == NULL)
+  if (new == NULL)
     return;
+  memcpy(&new[ab->len], s, len);
+  ab->b = new;
+  ab->len += len;
+}
+
+void abFree(struct abuf *ab)
+{
+  free(ab->b);
+}
 
-  char **keywords = E.syntax->keywords;
+/*** brackets ***/
 
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
+static const signed char bracketKind[256] = {
+    ['('] = 1, ['['] = 1, ['{'] = 1, [')'] = -1, [']'] = -1, ['}'] = -1};
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
+// 1 for an opening bracket at render index j, -1 for a closing one, 0 for
+// anything else including brackets in strings and comments
+int bracketAt(erow *row, int j)
+{
+  int hl = row->hl[j];
+  if (hl == HL_STRING || hl == HL_COMMENT || hl == HL_MLCOMMENT)
+    return 0;
+  return bracketKind[(unsigned char)row->render[j]];
+}
 
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+struct bracketSpan bracketJoin(struct bracketSpan a, struct bracketSpan b)
+{
+  struct bracketSpan s;
+  s.bclose = a.bclose + (b.bclose > a.bopen ? b.bclose - a.bopen : 0);
+  s.bopen = b.bopen + (a.bopen > b.bclose ? a.bopen - b.bclose : 0);
+  return s;
+}
 
-  int i = 0;
-  while (i < row->rsize)
+void bracketBuild(struct editorBuffer *b)
+{
+  if (b->brok)
+    return;
+  int size = 1;
+  while (size < b->numrows)
+    size *= 2;
+  if (size != b->brsize)
   {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-    if (scs_len && !in_string && !in_comment)
+    b->brtree = realloc(b->brtree, sizeof(struct bracketSpan) * 2 * size);
+    b->brsize = size;
+  }
+  for (int i = 0; i < size; i++)
+  {
+    struct bracketSpan leaf = {0, 0};
+    if (i < b->numrows)
     {
-      if (!strncmp(&row->render[i], scs, scs_len))
-      {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
+      leaf.bclose = b->row[i].bclose;
+      leaf.bopen = b->row[i].bopen;
     }
+    b->brtree[size + i] = leaf;
+  }
+  for (int i = size - 1; i >= 1; i--)
+    b->brtree[i] = bracketJoin(b->brtree[2 * i], b->brtree[2 * i + 1]);
+  b->brok = 1;
+}
+
+// Recounts the unmatched brackets of a row after its highlight changed
+void editorRowBrackets(erow *row)
+{
+  int bclose = 0, bopen = 0;
+  for (int j = 0; j < row->rsize; j++)
+  {
+    int k = bracketKind[(unsigned char)row->render[j]];
+    if (k == 0 || (k = bracketAt(row, j)) == 0)
+      continue;
+    if (k > 0)
+      bopen++;
+    else if (bopen)
+      bopen--;
+    else
+      bclose++;
+  }
+  if (bclose == row->bclose && bopen == row->bopen)
+    return;
+  row->bclose = bclose;
+  row->bopen = bopen;
+
+  struct editorBuffer *b = E.buf;
+  if (!b->brok)
+    return;
+  int i = b->brsize + row->idx;
+  b->brtree[i].bclose = bclose;
+  b->brtree[i].bopen = bopen;
+  for (i >>= 1; i >= 1; i >>= 1)
+    b->brtree[i] = bracketJoin(b->brtree[2 * i], b->brtree[2 * i + 1]);
+}
 
-    if (mcs_len && mce_len && !in_string)
+// First row from start on holding the closer that leaves none of need open
+// brackets unmatched, with *need set to what is still open where it starts
+int bracketFindClose(struct editorBuffer *b, int start, int *need)
+{
+  if (start >= b->numrows)
+    return -1;
+  struct bracketSpan *t = b->brtree;
+  int i = b->brsize + start;
+  while (t[i].bclose < *need)
+  {
+    *need += t[i].bopen - t[i].bclose;
+    while (i > 1 && (i & 1))
+      i >>= 1;
+    if (i == 1)
+      return -1;
+    i++;
+  }
+  while (i < b->brsize)
+  {
+    i *= 2;
+    if (t[i].bclose < *need)
     {
-      if (in_comment)
-      {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len))
-        {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        }
-        else
-        {
-          i++;
-          continue;
-        }
-      }
-      else if (!strncmp(&row->render[i], mcs, mcs_len))
-      {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
-        continue;
-      }
+      *need += t[i].bopen - t[i].bclose;
+      i++;
     }
+  }
+  return i - b->brsize;
+}
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
+// Last row up to start holding the opener of the first of need closers after it
+int bracketFindOpen(struct editorBuffer *b, int start, int *need)
+{
+  if (start < 0)
+    return -1;
+  struct bracketSpan *t = b->brtree;
+  int i = b->brsize + start;
+  while (t[i].bopen < *need)
+  {
+    *need += t[i].bclose - t[i].bopen;
+    while (i > 1 && !(i & 1))
+      i >>= 1;
+    if (i == 1)
+      return -1;
+    i--;
+  }
+  while (i < b->brsize)
+  {
+    i = 2 * i + 1;
+    if (t[i].bopen < *need)
     {
-      if (in_string)
-      {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize)
-        {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == in_string)
-          in_string = 0;
-        i++;
-        prev_sep = 1;
-        continue;
-      }
-      else
+      *need += t[i].bclose - t[i].bopen;
+      i--;
+    }
+  }
+  return i - b->brsize;
+}
+
+// Walks row from render index j in direction dir until need brackets are
+// closed (dir 1) or opened (dir -1), returns where or -1 with *need left over
+int editorRowScanBracket(erow *row, int j, int dir, int *need)
+{
+  for (; j >= 0 && j < row->rsize; j += dir)
+  {
+    *need += dir * bracketAt(row, j);
+    if (*need == 0)
+      return j;
+  }
+  return -1;
+}
+
+// Finds the bracket that closes (dir 1) or opens (dir -1) need brackets,
+// looking from render index rx of row cy on. Rows in between are skipped
+// through the tree, so only the first and last row are scanned.
+int editorFindBracket(int cy, int rx, int dir, int need, int *mrow, int *mrx)
+{
+  struct editorBuffer *b = E.buf;
+  if (cy >= b->numrows)
+    return 0;
+  editorFlushSyntax();
+  if (b->hlidle != -1) // rows loaded from a session count no brackets until highlighted
+    editorHighlightIdle(LLONG_MAX);
+  int r = cy, at = editorRowScanBracket(&b->row[cy], rx, dir, &need);
+  if (at < 0)
+  {
+    bracketBuild(b);
+    r = dir > 0 ? bracketFindClose(b, cy + 1, &need) : bracketFindOpen(b, cy - 1, &need);
+    if (r < 0)
+      return 0;
+    at = editorRowScanBracket(&b->row[r], dir > 0 ? 0 : b->row[r].rsize - 1, dir, &need);
+    if (at < 0)
+      return 0;
+  }
+  *mrow = r;
+  *mrx = at;
+  return 1;
+}
+
+// The bracket matching the one at render index rx of row cy
+int editorMatchBracket(int cy, int rx, int *mrow, int *mrx)
+{
+  if (cy >= E.buf->numrows || rx >= E.buf->row[cy].rsize)
+    return 0;
+  editorFlushSyntax();
+  int k = bracketAt(&E.buf->row[cy], rx);
+  return k != 0 && editorFindBracket(cy, rx + k, k, 1, mrow, mrx);
+}
+
+/*** syntax highlighting ***/
+
+static const unsigned char separators[256] = {
+    ['\0'] = 1, [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1,
+    ['\r'] = 1, [','] = 1, ['.'] = 1, ['('] = 1, [')'] = 1, ['+'] = 1,
+    ['-'] = 1, ['/'] = 1, ['*'] = 1, ['='] = 1, ['~'] = 1, ['%'] = 1,
+    ['<'] = 1, ['>'] = 1, ['['] = 1, [']'] = 1, [';'] = 1};
+
+int is_separator(int c)
+{
+  return separators[(unsigned char)c];
+}
+
+int is_word_byte(unsigned char c)
+{
+  return (unsigned char)((c | 0x20) - 'a') < 26 || (unsigned char)(c - '0') < 10 ||
+         c == '_' || c >= 0x80;
+}
+
+// Length of the run of identifier bytes ([A-Za-z0-9_] or non-ASCII) at s
+int syntaxWordRun(const char *s, int len)
+{
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i lo = _mm_set1_epi8('a' - 1), hi = _mm_set1_epi8('z' + 1);
+  const __m128i dlo = _mm_set1_epi8('0' - 1), dhi = _mm_set1_epi8('9' + 1);
+  const __m128i under = _mm_set1_epi8('_'), caps = _mm_set1_epi8(0x20);
+  for (; i + 16 <= len; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i folded = _mm_or_si128(x, caps);
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(folded, lo), _mm_cmplt_epi8(folded, hi));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(x, dlo), _mm_cmplt_epi8(x, dhi));
+    __m128i word = _mm_or_si128(_mm_or_si128(alpha, digit),
+                                _mm_or_si128(_mm_cmpeq_epi8(x, under),
+                                             _mm_cmplt_epi8(x, _mm_setzero_si128())));
+    int mask = _mm_movemask_epi8(word);
+    if (mask != 0xffff)
+      return i + __builtin_ctz(~mask);
+  }
+#endif
+  while (i < len && is_word_byte(s[i]))
+    i++;
+  return i;
+}
+
+// Highlights row, returning whether it changed the comment state the row
+// below starts in
+int editorHighlightRow(erow *row)
+{
+  row->hlstale = 0;
+  row->hl = realloc(row->hl, row->rsize + 1);
+  memset(row->hl, HL_NORMAL, row->rsize);
+  PROF_COUNT(hlbytes, row->rsize);
+  E.buf->version++;
+
+  const struct syntaxTable *tab = E.buf->syntax;
+  if (tab == NULL)
+  {
+    editorRowBrackets(row);
+    return 0;
+  }
+
+  TRACE_BEGIN(editorUpdateSyntax);
+  const unsigned char *cls = tab->cls;
+  char *render = row->render;
+  unsigned char *hl = row->hl;
+  const char *scs = SYNSTR(tab, tab->scs);
+  const char *mcs = SYNSTR(tab, tab->mcs);
+  const char *mce = SYNSTR(tab, tab->mce);
+  int scs_len = tab->scs_len;
+  int mcs_len = tab->mcs_len;
+  int mce_len = tab->mce_len;
+
+  int prev_sep = 1;
+  int in_string = 0;
+  int in_comment = (row->idx > 0 && E.buf->row[row->idx - 1].hl_open_comment);
+
+  int i = 0;
+  while (i < row->rsize)
+  {
+    unsigned char c = render[i];
+    unsigned char f = cls[c];
+
+    if (in_comment)
+    {
+      if ((f & CLS_MCE) && !strncmp(&render[i], mce, mce_len))
       {
-        if (c == '"' || c == '\'')
-        {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        }
+        memset(&hl[i], HL_MLCOMMENT, mce_len);
+        i += mce_len;
+        in_comment = 0;
+        prev_sep = 1;
+        continue;
+      }
+      // Nothing can happen before the next byte that may end the comment
+      char *end = memchr(&render[i + 1], mce[0], row->rsize - i - 1);
+      int next = end ? end - render : row->rsize;
+      memset(&hl[i], HL_MLCOMMENT, next - i);
+      i = next;
+      continue;
+    }
+
+    if (in_string)
+    {
+      hl[i] = HL_STRING;
+      if (c == '\\' && i + 1 < row->rsize)
+      {
+        hl[i + 1] = HL_STRING;
+        i += 2;
+        continue;
       }
+      if (c == in_string)
+        in_string = 0;
+      i++;
+      prev_sep = 1;
+      continue;
+    }
+
+    // Inside an identifier nothing but a separator, comment or quote can
+    // change state, so jump over the rest of it in one go
+    if (!prev_sep && tab->wordsafe && is_word_byte(c) && hl[i - 1] != HL_NUMBER)
+    {
+      i += syntaxWordRun(&render[i], row->rsize - i);
+      continue;
+    }
+
+    if ((f & CLS_SCS) && !strncmp(&render[i], scs, scs_len))
+    {
+      memset(&hl[i], HL_COMMENT, row->rsize - i);
+      break;
+    }
+
+    if ((f & CLS_MCS) && !strncmp(&render[i], mcs, mcs_len))
+    {
+      memset(&hl[i], HL_MLCOMMENT, mcs_len);
+      i += mcs_len;
+      in_comment = 1;
+      continue;
     }
 
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
+    if (f & CLS_QUOTE)
     {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+      in_string = c;
+      hl[i++] = HL_STRING;
+      continue;
+    }
+
+    if (f & CLS_NUM)
+    {
+      unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+      if ((c != '.' && (prev_sep || prev_hl == HL_NUMBER)) ||
           (c == '.' && prev_hl == HL_NUMBER))
       {
-        row->hl[i] = HL_NUMBER;
-        i++;
+        hl[i++] = HL_NUMBER;
         prev_sep = 0;
         continue;
       }
     }
 
-    if (prev_sep)
+    if (prev_sep && (f & CLS_KW))
     {
       int j;
-      for (j = 0; keywords[j]; j++)
+      for (j = tab->kwstart[c]; j < tab->kwstart[c + 1]; j++)
       {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2)
-          klen--;
-
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen]))
+        const struct editorKeyword *kw = &tab->kw[j];
+        if (!strncmp(&render[i], SYNSTR(tab, kw->word), kw->len) &&
+            (cls[(unsigned char)render[i + kw->len]] & CLS_SEP))
         {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
+          memset(&hl[i], kw->hl, kw->len);
+          i += kw->len;
           break;
         }
       }
-      if (keywords[j] != NULL)
+      if (j < tab->kwstart[c + 1])
       {
         prev_sep = 0;
         continue;
       }
     }
 
-    prev_sep = is_separator(c);
+    prev_sep = f & CLS_SEP;
     i++;
   }
 
   int changed = (row->hl_open_comment != in_comment);
   row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+  editorRowBrackets(row);
+  TRACE_END(editorUpdateSyntax);
+  return changed;
+}
+
+// Highlights row and the rows below it for as long as the comment state
+// they start in changes. A loop, as a comment opened at the top of a big
+// file reaches every row below.
+void editorUpdateSyntax(erow *row)
+{
+  while (editorHighlightRow(row) && row->idx + 1 < E.buf->numrows)
+    row = &E.buf->row[row->idx + 1];
+}
+
+// Highlights row, or while a macro runs only notes that it has to be. Rows
+// loading with the comment state they had last session wait until shown.
+void editorRowSyntax(erow *row)
+{
+  struct editorBuffer *b = E.buf;
+  int known = b->comments && !E.journal && row->idx < b->session->numrows;
+  if (!E.replaying && !known)
+  {
+    editorUpdateSyntax(row);
+    return;
+  }
+  row->hl = realloc(row->hl, row->rsize + 1);
+  memset(row->hl, HL_NORMAL, row->rsize);
+  row->hlstale = 1;
+  if (known)
+  {
+    row->hl_open_comment = b->comments[row->idx >> 3] >> (row->idx & 7) & 1;
+    if (b->hlidle == -1 || b->hlidle > row->idx)
+      b->hlidle = row->idx;
+    b->version++;
+    return;
+  }
+  if (b->hlfrom > b->hlto)
+    b->hlfrom = b->hlto = row->idx;
+  else if (row->idx < b->hlfrom)
+    b->hlfrom = row->idx;
+  else if (row->idx > b->hlto)
+    b->hlto = row->idx;
+  b->version++;
+}
+
+// Highlights the rows editorRowSyntax left stale, going down so comment
+// state flows on like it does for single edits
+void editorFlushSyntax()
+{
+  struct editorBuffer *b = E.buf;
+  int from = b->hlfrom, to = b->hlto;
+  b->hlfrom = 1;
+  b->hlto = 0;
+  for (int j = from; j <= to && j < b->numrows; j++)
+    if (b->row[j].hlstale)
+      editorUpdateSyntax(&b->row[j]);
+}
+
+// Highlights the rows a view shows that loading left for later
+void editorHighlightShown(struct editorView *v)
+{
+  struct editorBuffer *shown = E.buf, *b = v->buf;
+  if (b->hlidle == -1)
+    return;
+  E.buf = b; // highlighting only looks at the rows, not the cursor
+  for (int j = v->rowoff; j < v->rowoff + v->rows && j < b->numrows; j++)
+    if (b->row[j].hlstale)
+      editorUpdateSyntax(&b->row[j]);
+  E.buf = shown;
+}
+
+// Highlights the rest of what loading left, a few hundred rows per clock check.
+// Bracket lookups finish it first, as the rows' bracket counts need it.
+void editorHighlightIdle(long long deadline)
+{
+  struct editorBuffer *b = E.buf;
+  while (b->hlidle < b->numrows && clockNs() < deadline)
+  {
+    for (int end = b->hlidle + 256; b->hlidle < end && b->hlidle < b->numrows; b->hlidle++)
+      if (b->row[b->hlidle].hlstale)
+        editorUpdateSyntax(&b->row[b->hlidle]);
+  }
+  if (b->hlidle >= b->numrows)
+    b->hlidle = -1;
+}
+
+// Keeps the stale range on its rows when rows at..at+del become n rows
+void editorSyntaxShift(int at, int del, int n)
+{
+  struct editorBuffer *b = E.buf;
+  if (b->hlidle > at)
+    b->hlidle = at;
+  if (b->hlfrom > b->hlto)
+    return;
+  if (b->hlfrom >= at + del)
+    b->hlfrom += n - del;
+  else if (b->hlfrom > at)
+    b->hlfrom = at;
+  if (b->hlto >= at + del)
+    b->hlto += n - del;
+  else if (b->hlto >= at)
+    b->hlto = at - 1;
 }
 
 int editorSyntaxToColor(int hl)
@@ -465,819 +1339,5857 @@ int editorSyntaxToColor(int hl)
   }
 }
 
-void editorSelectSyntaxHighlight()
+void abAlign(struct abuf *ab)
 {
-  E.syntax = NULL;
-  if (E.filename == NULL)
-    return;
+  static const char zero[8];
+  if (ab->len % 8)
+    abAppend(ab, zero, 8 - ab->len % 8);
+}
 
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+unsigned int abAppendString(struct abuf *ab, const char *s, int len)
+{
+  unsigned int off = ab->len;
+  abAppend(ab, s, len);
+  abAppend(ab, "", 1);
+  return off;
+}
+
+// Appends the compiled table for s to img and returns its offset
+unsigned int editorCompileSyntax(struct abuf *img, struct editorSyntax *s)
+{
+  int nkw = 0;
+  for (int j = 0; s->keywords[j]; j++)
+    if (s->keywords[j][0] != '\0' && s->keywords[j][0] != '|')
+      nkw++;
+
+  struct syntaxTable *tab = calloc(1, sizeof(struct syntaxTable) +
+                                          sizeof(struct editorKeyword) * nkw);
+  struct abuf pool = ABUF_INIT;
+  abAppend(&pool, "", 1); // offset 0 stays "unset"
+  unsigned int base = sizeof(struct syntaxTable) + sizeof(struct editorKeyword) * nkw;
+
+  char *scs = s->singleline_comment_start;
+  char *mcs = s->multiline_comment_start;
+  char *mce = s->multiline_comment_end;
+  tab->scs_len = scs ? strlen(scs) : 0;
+  tab->mcs_len = mcs ? strlen(mcs) : 0;
+  tab->mce_len = mce ? strlen(mce) : 0;
+  tab->filetype = base + abAppendString(&pool, s->filetype, strlen(s->filetype));
+  if (tab->scs_len)
+    tab->scs = base + abAppendString(&pool, scs, tab->scs_len);
+  if (tab->mcs_len && tab->mce_len)
   {
-    struct editorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i])
-    {
-      char *p = strstr(E.filename, s->filematch[i]);
-      if (p != NULL)
-      {
-        int patlen = strlen(s->filematch[i]);
-        if (s->filematch[i][0] != '.' || p[patlen] == '\0')
-        {
-          E.syntax = s;
+    tab->mcs = base + abAppendString(&pool, mcs, tab->mcs_len);
+    tab->mce = base + abAppendString(&pool, mce, tab->mce_len);
+  }
+  tab->flags = s->flags;
 
-          int filerow;
-          for (filerow = 0; filerow < E.numrows; filerow++)
-          {
-            editorUpdateSyntax(&E.row[filerow]);
-          }
+  for (int c = 0; c < 256; c++)
+  {
+    if (is_separator(c))
+      tab->cls[c] |= CLS_SEP;
+    if ((s->flags & HL_HIGHLIGHT_NUMBERS) && (isdigit(c) || c == '.'))
+      tab->cls[c] |= CLS_NUM;
+  }
+  if (s->flags & HL_HIGHLIGHT_STRINGS)
+    for (char *q = s->quotes ? s->quotes : "\"'"; *q; q++)
+      tab->cls[(unsigned char)*q] |= CLS_QUOTE;
+  if (tab->scs_len)
+    tab->cls[(unsigned char)scs[0]] |= CLS_SCS;
+  if (tab->mcs_len && tab->mce_len)
+  {
+    tab->cls[(unsigned char)mcs[0]] |= CLS_MCS;
+    tab->cls[(unsigned char)mce[0]] |= CLS_MCE;
+  }
+  tab->wordsafe = 1;
+  for (int c = 0; c < 256; c++)
+    if (is_word_byte(c) && (tab->cls[c] & (CLS_SEP | CLS_SCS | CLS_MCS | CLS_QUOTE)))
+      tab->wordsafe = 0;
+
+  // Bucket the keywords by first byte, keeping their order within a bucket
+  for (int j = 0; s->keywords[j]; j++)
+    if (s->keywords[j][0] != '\0' && s->keywords[j][0] != '|')
+      tab->kwstart[(unsigned char)s->keywords[j][0] + 1]++;
+  for (int c = 0; c < 256; c++)
+    tab->kwstart[c + 1] += tab->kwstart[c];
+
+  int fill[256];
+  memcpy(fill, tab->kwstart, sizeof(fill));
+  for (int j = 0; s->keywords[j]; j++)
+  {
+    char *word = s->keywords[j];
+    int len = strlen(word);
+    if (len == 0 || word[0] == '|')
+      continue;
+    int kw2 = word[len - 1] == '|';
+    unsigned char first = word[0];
+    struct editorKeyword *kw = &tab->kw[fill[first]++];
+    kw->len = kw2 ? len - 1 : len;
+    kw->word = base + abAppendString(&pool, word, kw->len);
+    kw->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+    tab->cls[first] |= CLS_KW;
+  }
+  tab->size = base + pool.len;
+
+  abAlign(img);
+  unsigned int off = img->len;
+  abAppend(img, (char *)tab, base);
+  abAppend(img, pool.b, pool.len);
+  free(tab);
+  abFree(&pool);
+  return off;
+}
 
-          return;
-        }
+char **syntaxListAppend(char **list, int *len, char *word)
+{
+  list = realloc(list, sizeof(char *) * (*len + 2));
+  if (word)
+    list[(*len)++] = word;
+  list[*len] = NULL;
+  return list;
+}
+
+int editorParseSyntax(const char *path, struct editorSyntax *s)
+{
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+
+  memset(s, 0, sizeof(*s));
+  int nmatch = 0, nkeywords = 0, ninterpreters = 0;
+  s->filematch = syntaxListAppend(NULL, &nmatch, NULL);
+  s->keywords = syntaxListAppend(NULL, &nkeywords, NULL);
+  s->interpreters = syntaxListAppend(NULL, &ninterpreters, NULL);
+
+  const char *delim = " \t\r\n";
+  char *line = NULL;
+  size_t linecap = 0;
+  while (getline(&line, &linecap, fp) != -1)
+  {
+    char *save;
+    char *key = strtok_r(line, delim, &save);
+    if (key == NULL || key[0] == '#')
+      continue;
+
+    char *arg = strtok_r(NULL, delim, &save);
+    if (!strcmp(key, "filetype") && arg)
+    {
+      s->filetype = strdup(arg);
+    }
+    else if (!strcmp(key, "match"))
+    {
+      for (; arg; arg = strtok_r(NULL, delim, &save))
+        s->filematch = syntaxListAppend(s->filematch, &nmatch, strdup(arg));
+    }
+    else if (!strcmp(key, "interpreter"))
+    {
+      for (; arg; arg = strtok_r(NULL, delim, &save))
+        s->interpreters = syntaxListAppend(s->interpreters, &ninterpreters, strdup(arg));
+    }
+    else if (!strcmp(key, "keywords") || !strcmp(key, "types"))
+    {
+      for (; arg; arg = strtok_r(NULL, delim, &save))
+      {
+        char *word = malloc(strlen(arg) + 2);
+        strcpy(word, arg);
+        if (key[0] == 't')
+          strcat(word, "|");
+        s->keywords = syntaxListAppend(s->keywords, &nkeywords, word);
       }
-      i++;
+    }
+    else if (!strcmp(key, "comment") && arg)
+    {
+      s->singleline_comment_start = strdup(arg);
+    }
+    else if (!strcmp(key, "multiline") && arg)
+    {
+      char *end = strtok_r(NULL, delim, &save);
+      if (end)
+      {
+        s->multiline_comment_start = strdup(arg);
+        s->multiline_comment_end = strdup(end);
+      }
+    }
+    else if (!strcmp(key, "numbers"))
+    {
+      s->flags |= HL_HIGHLIGHT_NUMBERS;
+    }
+    else if (!strcmp(key, "strings"))
+    {
+      s->flags |= HL_HIGHLIGHT_STRINGS;
+      if (arg)
+        s->quotes = strdup(arg);
     }
   }
-}
+  free(line);
+  fclose(fp);
 
-/*** row operations ***/
+  return s->filetype ? 0 : -1;
+}
 
-int editorRowCxToRx(erow *row, int cx)
+void editorFreeSyntax(struct editorSyntax *s)
 {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++)
+  char **lists[] = {s->filematch, s->keywords, s->interpreters};
+  for (unsigned int j = 0; j < sizeof(lists) / sizeof(lists[0]); j++)
   {
-    if (row->chars[j] == '\t')
-      rx += (SEX_TAB_STOP - 1) - (rx % SEX_TAB_STOP);
-    rx++;
+    for (int i = 0; lists[j] && lists[j][i]; i++)
+      free(lists[j][i]);
+    free(lists[j]);
   }
-  return rx;
+  free(s->filetype);
+  free(s->singleline_comment_start);
+  free(s->multiline_comment_start);
+  free(s->multiline_comment_end);
+  free(s->quotes);
 }
 
-int editorRowRxToCx(erow *row, int rx)
+// $XDG_<env>/sex/<leaf>, or ~/<fallback>/sex/<leaf>
+char *editorXdgPath(char *buf, size_t size, const char *env, const char *fallback,
+                    const char *leaf)
 {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++)
-  {
-    if (row->chars[cx] == '\t')
-      cur_rx += (SEX_TAB_STOP - 1) - (cur_rx % SEX_TAB_STOP);
-    cur_rx++;
+  char *xdg = getenv(env);
+  char *home = getenv("HOME");
+  if (xdg && *xdg)
+    snprintf(buf, size, "%s/sex/%s", xdg, leaf);
+  else if (home)
+    snprintf(buf, size, "%s/%s/sex/%s", home, fallback, leaf);
+  else
+    return NULL;
+  return buf;
+}
 
-    if (cur_rx > rx)
-      return cx;
+void syntaxMapInsert(struct abuf *img, unsigned int slots, unsigned int nslots,
+                     const char *key, int syn)
+{
+  int len = strlen(key);
+  unsigned int h = editorHash(key, len, HASH_INIT) & (nslots - 1);
+  struct syntaxSlot *slot;
+  while ((slot = (struct syntaxSlot *)(img->b + slots) + h)->key)
+  {
+    if (!strcmp(img->b + slot->key, key))
+      return; // an earlier definition already claimed it
+    h = (h + 1) & (nslots - 1);
   }
-  return cx;
+  unsigned int off = abAppendString(img, key, len);
+  slot = (struct syntaxSlot *)(img->b + slots) + h;
+  slot->key = off;
+  slot->syn = syn;
 }
 
-void editorUpdateRow(erow *row)
+// Lays out the compiled tables and lookup map for defs as one image
+void editorBuildSyntaxCache(struct abuf *img, struct editorSyntax *defs, int n,
+                            unsigned long long fingerprint)
 {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t')
-      tabs++;
+  struct syntaxCache hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  abAppend(img, (char *)&hdr, sizeof(hdr));
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (SEX_TAB_STOP - 1) + 1);
+  int nkeys = 0, npatterns = 0;
+  for (int j = 0; j < n; j++)
+  {
+    nkeys += 1;
+    for (int i = 0; defs[j].filematch[i]; i++)
+    {
+      if (defs[j].filematch[i][0] == '.')
+        nkeys++;
+      else
+        npatterns++;
+    }
+    for (int i = 0; defs[j].interpreters && defs[j].interpreters[i]; i++)
+      nkeys++;
+  }
+  unsigned int nslots = 16;
+  while (nslots < (unsigned int)nkeys * 2)
+    nslots *= 2;
+
+  abAlign(img);
+  unsigned int tables = img->len;
+  unsigned int *offsets = calloc(n, sizeof(unsigned int));
+  abAppend(img, (char *)offsets, n * sizeof(unsigned int)); // patched below
+  free(offsets);
+  for (int j = 0; j < n; j++)
+  {
+    unsigned int off = editorCompileSyntax(img, &defs[j]);
+    ((unsigned int *)(img->b + tables))[j] = off;
+  }
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++)
+  abAlign(img);
+  unsigned int slots = img->len;
+  struct syntaxSlot *empty = calloc(nslots, sizeof(struct syntaxSlot));
+  abAppend(img, (char *)empty, nslots * sizeof(struct syntaxSlot));
+  free(empty);
+  unsigned int patterns = img->len;
+  empty = calloc(npatterns + 1, sizeof(struct syntaxSlot));
+  abAppend(img, (char *)empty, npatterns * sizeof(struct syntaxSlot));
+  free(empty);
+
+  char key[256];
+  int p = 0;
+  for (int j = 0; j < n; j++)
   {
-    if (row->chars[j] == '\t')
+    snprintf(key, sizeof(key), "ft:%s", defs[j].filetype);
+    syntaxMapInsert(img, slots, nslots, key, j);
+    for (int i = 0; defs[j].interpreters && defs[j].interpreters[i]; i++)
     {
-      row->render[idx++] = ' ';
-      while (idx % SEX_TAB_STOP != 0)
-        row->render[idx++] = ' ';
+      snprintf(key, sizeof(key), "#!%s", defs[j].interpreters[i]);
+      syntaxMapInsert(img, slots, nslots, key, j);
     }
-    else
+    for (int i = 0; defs[j].filematch[i]; i++)
     {
-      row->render[idx++] = row->chars[j];
+      char *pat = defs[j].filematch[i];
+      if (pat[0] == '.')
+      {
+        syntaxMapInsert(img, slots, nslots, pat, j);
+      }
+      else
+      {
+        unsigned int off = abAppendString(img, pat, strlen(pat));
+        struct syntaxSlot *slot = (struct syntaxSlot *)(img->b + patterns) + p++;
+        slot->key = off;
+        slot->syn = j;
+      }
     }
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
 
-  editorUpdateSyntax(row);
+  abAlign(img);
+  struct syntaxCache *h = (struct syntaxCache *)img->b;
+  memcpy(h->magic, SEX_CACHE_MAGIC, sizeof(h->magic));
+  h->fingerprint = fingerprint;
+  h->size = img->len;
+  h->nsyntax = n;
+  h->tables = tables;
+  h->nslots = nslots;
+  h->slots = slots;
+  h->npatterns = npatterns;
+  h->patterns = patterns;
 }
 
-void editorInsertRow(int at, char *s, size_t len)
+// Whether off..off+len lies in an image of size bytes, aligned for an int
+int syntaxCacheSpan(unsigned int size, unsigned int off, unsigned long long len)
 {
-  if (at < 0 || at > E.numrows)
-    return;
-
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++)
-    E.row[j].idx++;
-
-  E.row[at].idx = at;
-
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
-
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
-
-  E.numrows++;
-  E.dirty++;
+  return off % sizeof(int) == 0 && off <= size && len <= size - off;
 }
 
-void editorFreeRow(erow *row)
+// Whether every offset in c stays inside it, so a damaged or hand-made cache
+// cannot send a lookup outside the mapping. Strings only need to start inside
+// it, the image ends in a NUL.
+int editorCheckSyntaxCache(const struct syntaxCache *c)
 {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+  const char *img = (const char *)c;
+  unsigned int size = c->size;
+  if (img[size - 1] != '\0' || c->nsyntax == 0 ||
+      !syntaxCacheSpan(size, c->tables, (unsigned long long)c->nsyntax * sizeof(unsigned int)) ||
+      c->nslots == 0 || (c->nslots & (c->nslots - 1)) ||
+      !syntaxCacheSpan(size, c->slots, (unsigned long long)c->nslots * sizeof(struct syntaxSlot)) ||
+      !syntaxCacheSpan(size, c->patterns, (unsigned long long)c->npatterns * sizeof(struct syntaxSlot)))
+    return 0;
+
+  const unsigned int *tables = (const unsigned int *)(img + c->tables);
+  for (unsigned int j = 0; j < c->nsyntax; j++)
+  {
+    if (!syntaxCacheSpan(size, tables[j], sizeof(struct syntaxTable)))
+      return 0;
+    const struct syntaxTable *t = (const struct syntaxTable *)(img + tables[j]);
+    unsigned int tsize = t->size;
+    if (tsize < sizeof(struct syntaxTable) || tsize > size - tables[j] ||
+        t->filetype >= tsize || t->scs >= tsize || t->mcs >= tsize || t->mce >= tsize ||
+        t->scs_len < 0 || (unsigned int)t->scs_len >= tsize - t->scs ||
+        t->mcs_len < 0 || (unsigned int)t->mcs_len >= tsize - t->mcs ||
+        t->mce_len < 0 || (unsigned int)t->mce_len >= tsize - t->mce ||
+        t->kwstart[0] != 0)
+      return 0;
+    for (int b = 0; b < 256; b++)
+      if (t->kwstart[b + 1] < t->kwstart[b])
+        return 0;
+    if ((unsigned int)t->kwstart[256] >
+        (tsize - sizeof(struct syntaxTable)) / sizeof(struct editorKeyword))
+      return 0;
+    for (int k = 0; k < t->kwstart[256]; k++)
+      if (t->kw[k].word >= tsize || t->kw[k].len < 0 ||
+          (unsigned int)t->kw[k].len >= tsize - t->kw[k].word)
+        return 0;
+  }
+
+  const struct syntaxSlot *slots = (const struct syntaxSlot *)(img + c->slots);
+  int empty = 0;
+  for (unsigned int j = 0; j < c->nslots; j++)
+  {
+    if (slots[j].key == 0)
+      empty = 1; // lookups stop at one
+    else if (slots[j].key >= size || (unsigned int)slots[j].syn >= c->nsyntax)
+      return 0;
+  }
+  const struct syntaxSlot *patterns = (const struct syntaxSlot *)(img + c->patterns);
+  for (unsigned int j = 0; j < c->npatterns; j++)
+    if (patterns[j].key >= size || (unsigned int)patterns[j].syn >= c->nsyntax)
+      return 0;
+  return empty;
 }
 
-void editorDelRow(int at)
+struct syntaxCache *editorMapSyntaxCache(const char *path, unsigned long long fingerprint)
 {
-  if (at < 0 || at >= E.numrows)
-    return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  for (int j = at; j < E.numrows - 1; j++)
-    E.row[j].idx--;
-  E.numrows--;
-  E.dirty++;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct syntaxCache))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  struct syntaxCache *c = map;
+  if (memcmp(c->magic, SEX_CACHE_MAGIC, sizeof(c->magic)) ||
+      c->fingerprint != fingerprint || c->size != st.st_size || !editorCheckSyntaxCache(c))
+  {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  return c;
 }
 
-void editorRowInsertChar(erow *row, int at, int c)
+// Replaces path with img through a temporary file, making its directories
+void editorWriteCache(const char *path, struct abuf *img)
 {
-  if (at < 0 || at > row->size)
-    at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+  char dir[PATH_MAX], tmp[PATH_MAX + 16];
+  snprintf(dir, sizeof(dir), "%s", path);
+  for (char *p = dir + 1; *p; p++) // mkdir -p of the cache directory
+  {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    mkdir(dir, 0755);
+    *p = '/';
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return;
+  int ok = write(fd, img->b, img->len) == img->len;
+  close(fd);
+  if (!ok || rename(tmp, path) == -1)
+    unlink(tmp);
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len)
+// Hashes s with its NUL so neighbouring strings cannot run together, and
+// NULL apart from ""
+unsigned long long syntaxHashString(const char *s, unsigned long long h)
 {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+  return s ? editorHash(s, strlen(s) + 1, h) : editorHash("\xff", 1, h);
 }
 
-void editorRowDelChar(erow *row, int at)
+unsigned long long syntaxHashList(char **list, unsigned long long h)
 {
-  if (at < 0 || at >= row->size)
-    return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+  for (int i = 0; list && list[i]; i++)
+    h = syntaxHashString(list[i], h);
+  return syntaxHashString(NULL, h); // ends the list
 }
 
-/*** editor operations ***/
-
-void editorInsertChar(int c)
+void editorLoadSyntaxes()
 {
-  if (E.cy == E.numrows)
+  char dir[PATH_MAX];
+  struct dirent **names = NULL;
+  int n = editorXdgPath(dir, sizeof(dir), "XDG_CONFIG_HOME", ".config", "syntax")
+              ? scandir(dir, &names, NULL, alphasort)
+              : -1;
+  if (n < 0)
+    n = 0;
+
+  // The cache is keyed on the name, size and mtime of every definition file
+  // and on every field of the built-in table, so it only gets rebuilt when
+  // one changes
+  unsigned long long fp = editorHash(SEX_CACHE_MAGIC, sizeof(SEX_CACHE_MAGIC), HASH_INIT);
+  fp = editorHash((char *)&(int){sizeof(struct syntaxTable)}, sizeof(int), fp);
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
   {
-    editorInsertRow(E.numrows, "", 0);
+    struct editorSyntax *d = &HLDB[j];
+    fp = syntaxHashString(d->filetype, fp);
+    fp = syntaxHashList(d->filematch, fp);
+    fp = syntaxHashList(d->keywords, fp);
+    fp = syntaxHashString(d->singleline_comment_start, fp);
+    fp = syntaxHashString(d->multiline_comment_start, fp);
+    fp = syntaxHashString(d->multiline_comment_end, fp);
+    fp = editorHash((char *)&d->flags, sizeof(d->flags), fp);
+    fp = syntaxHashString(d->quotes, fp);
+    fp = syntaxHashList(d->interpreters, fp);
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
-}
-
-void editorInsertNewline()
-{
-  if (E.cx == 0)
+  int nfiles = 0;
+  for (int j = 0; j < n; j++)
   {
-    editorInsertRow(E.cy, "", 0);
+    char *name = names[j]->d_name;
+    int len = strlen(name);
+    char path[PATH_MAX + 256];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (len <= 7 || strcmp(name + len - 7, ".syntax") || stat(path, &st) == -1)
+    {
+      names[j]->d_name[0] = '\0';
+      continue;
+    }
+    fp = editorHash(name, len, fp);
+    fp = editorHash((char *)&st.st_size, sizeof(st.st_size), fp);
+    fp = editorHash((char *)&st.st_mtim, sizeof(st.st_mtim), fp);
+    nfiles++;
   }
-  else
+
+  char cache[PATH_MAX];
+  int have_cache = editorXdgPath(cache, sizeof(cache), "XDG_CACHE_HOME", ".cache",
+                                 "syntax.cache") != NULL;
+  if (have_cache)
+    SC = editorMapSyntaxCache(cache, fp);
+
+  if (SC == NULL)
   {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    // Loaded definitions come first so they can override a built-in filetype
+    struct editorSyntax *defs = malloc(sizeof(struct editorSyntax) * (nfiles + HLDB_ENTRIES));
+    int ndefs = 0, nloaded;
+    for (int j = 0; j < n; j++)
+    {
+      char path[PATH_MAX + 256];
+      if (names[j]->d_name[0] == '\0')
+        continue;
+      snprintf(path, sizeof(path), "%s/%s", dir, names[j]->d_name);
+      if (editorParseSyntax(path, &defs[ndefs]) == 0)
+        ndefs++;
+    }
+    nloaded = ndefs;
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+      defs[ndefs++] = HLDB[j];
+
+    struct abuf img = ABUF_INIT;
+    editorBuildSyntaxCache(&img, defs, ndefs, fp);
+    if (have_cache)
+      editorWriteCache(cache, &img);
+    SC = (struct syntaxCache *)img.b;
+
+    for (int j = 0; j < nloaded; j++)
+      editorFreeSyntax(&defs[j]);
+    free(defs);
   }
-  E.cy++;
-  E.cx = 0;
+
+  for (int j = 0; j < n; j++)
+    free(names[j]);
+  free(names);
 }
 
-void editorDelChar()
+const struct syntaxTable *syntaxTableAt(int syn)
 {
-  if (E.cy == E.numrows)
-    return;
-  if (E.cx == 0 && E.cy == 0)
-    return;
+  unsigned int *tables = (unsigned int *)((char *)SC + SC->tables);
+  return (const struct syntaxTable *)((char *)SC + tables[syn]);
+}
 
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0)
+const struct syntaxTable *syntaxLookup(const char *prefix, const char *key, int len)
+{
+  if (SC == NULL || len <= 0)
+    return NULL;
+
+  char buf[256];
+  int buflen = snprintf(buf, sizeof(buf), "%s%.*s", prefix, len, key);
+  if (buflen >= (int)sizeof(buf))
+    return NULL;
+
+  struct syntaxSlot *slots = (struct syntaxSlot *)((char *)SC + SC->slots);
+  unsigned int mask = SC->nslots - 1;
+  for (unsigned int h = editorHash(buf, buflen, HASH_INIT) & mask; slots[h].key; h = (h + 1) & mask)
+    if (!strcmp((char *)SC + slots[h].key, buf))
+      return syntaxTableAt(slots[h].syn);
+  return NULL;
+}
+
+const struct syntaxTable *editorDetectByName(const char *filename)
+{
+  // Non-extension patterns are matched as substrings, in definition order
+  struct syntaxSlot *patterns = (struct syntaxSlot *)((char *)SC + SC->patterns);
+  int best = -1;
+  for (unsigned int j = 0; j < SC->npatterns; j++)
   {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
+    if (strstr(filename, (char *)SC + patterns[j].key))
+    {
+      best = patterns[j].syn;
+      break;
+    }
   }
-  else
+
+  // Extensions: every suffix of the base name that starts with a '.'
+  const char *base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
+  for (const char *dot = strchr(base, '.'); dot; dot = strchr(dot + 1, '.'))
   {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
+    const struct syntaxTable *tab = syntaxLookup("", dot, strlen(dot));
+    if (tab && (best == -1 || tab < syntaxTableAt(best)))
+      return tab; // tables are laid out in definition order
   }
+  return best == -1 ? NULL : syntaxTableAt(best);
 }
 
-/*** file i/o ***/
-
-char *editorRowsToString(int *buflen)
+// Start of a vim modeline marker in s, which like vim takes "vim:", "vi:" or
+// "ex:" only at the start of the line or after a blank, not in "regex:"
+char *modelineMarker(char *s)
 {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1;
-  *buflen = totlen;
-
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++)
+  for (char *p = s; *p; p++)
   {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+    if (p > s && !isspace((unsigned char)p[-1]))
+      continue;
+    if (!strncmp(p, "vim:", 4) || !strncmp(p, "vi:", 3) || !strncmp(p, "ex:", 3))
+      return p;
   }
-
-  return buf;
+  return NULL;
 }
 
-void editorOpen(char *filename)
+const struct syntaxTable *editorDetectByModeline(erow *row)
 {
-  free(E.filename);
-  E.filename = strdup(filename);
-
-  editorSelectSyntaxHighlight();
-
-  FILE *fp = fopen(filename, "r");
-  if (!fp)
-    die("fopen");
-
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1)
+  // vim: "vim: set ft=python:" / "vi: syntax=python", emacs: "-*- mode: python -*-"
+  char *p, *name = NULL;
+  if ((p = modelineMarker(row->chars)))
   {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+    char *ft;
+    if ((ft = strstr(p, "ft=")))
+      name = ft + 3;
+    else if ((ft = strstr(p, "filetype=")))
+      name = ft + 9;
+    else if ((ft = strstr(p, "syntax=")))
+      name = ft + 7;
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+  else if ((p = strstr(row->chars, "-*-")))
+  {
+    char *mode = strstr(p + 3, "mode:");
+    name = mode ? mode + 5 : p + 3;
+    while (*name == ' ')
+      name++;
+  }
+  if (name == NULL)
+    return NULL;
+
+  int len = 0;
+  while (name[len] && (isalnum((unsigned char)name[len]) || name[len] == '_' ||
+                       name[len] == '+' || name[len] == '-'))
+    len++;
+  if (len > 0 && name[len - 1] == '-') // "-*- python -*-"
+    len--;
+  char lower[64];
+  if (len >= (int)sizeof(lower))
+    return NULL;
+  for (int j = 0; j < len; j++)
+    lower[j] = tolower((unsigned char)name[j]);
+  return syntaxLookup("ft:", lower, len);
 }
 
-void editorSave()
+const struct syntaxTable *editorDetectByShebang(erow *row)
 {
-  if (E.filename == NULL)
+  if (row->size < 3 || row->chars[0] != '#' || row->chars[1] != '!')
+    return NULL;
+
+  // "#!/usr/bin/env python3" and "#!/bin/bash -e" both name the interpreter
+  char *p = row->chars + 2;
+  char *end;
+  for (;;)
   {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL)
+    while (*p == ' ' || *p == '\t')
+      p++;
+    end = p + strcspn(p, " \t");
+    char *slash = p;
+    for (char *q = p; q < end; q++)
+      if (*q == '/')
+        slash = q + 1;
+    if (end - slash == 3 && !strncmp(slash, "env", 3) && *end)
     {
-      editorSetStatusMessage("Save aborted");
-      return;
+      p = end;
+      continue;
     }
-    editorSelectSyntaxHighlight();
+    p = slash;
+    break;
   }
 
-  int len;
-  char *buf = editorRowsToString(&len);
+  // python3.11 -> python3 -> python
+  int len = end - p;
+  while (len > 0)
+  {
+    const struct syntaxTable *tab = syntaxLookup("#!", p, len);
+    if (!tab)
+      tab = syntaxLookup("ft:", p, len);
+    if (tab)
+      return tab;
+    if (!isdigit((unsigned char)p[len - 1]) && p[len - 1] != '.')
+      break;
+    len--;
+  }
+  return NULL;
+}
 
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1)
+const struct syntaxTable *editorDetectSyntax()
+{
+  const struct syntaxTable *tab = NULL;
+  if (SC == NULL)
+    return NULL;
+
+  for (int j = 0; j < E.buf->numrows && j < 5 && !tab; j++)
+    tab = editorDetectByModeline(&E.buf->row[j]);
+  for (int j = E.buf->numrows - 1; j >= 5 && j >= E.buf->numrows - 5 && !tab; j--)
+    tab = editorDetectByModeline(&E.buf->row[j]);
+  if (!tab && E.buf->filename && E.buf->codec) // foo.c.gz is C
   {
-    if (ftruncate(fd, len) != -1)
-    {
-      if (write(fd, buf, len) == len)
-      {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
-    }
-    close(fd);
+    char *name = strndup(E.buf->filename, strlen(E.buf->filename) - strlen(E.buf->codec->ext));
+    tab = editorDetectByName(name);
+    free(name);
   }
+  else if (!tab && E.buf->filename)
+    tab = editorDetectByName(E.buf->filename);
+  if (!tab && E.buf->numrows > 0)
+    tab = editorDetectByShebang(&E.buf->row[0]);
+  return tab;
+}
 
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+void editorSelectSyntaxHighlight()
+{
+  const struct syntaxTable *tab = editorDetectSyntax();
+  if (tab == E.buf->syntax)
+    return;
+
+  E.buf->syntax = tab;
+  if (E.buf->comments) // still loading, editorSessionEnd highlights if it has to
+    return;
+  PROF_BEGIN(PH_SYNTAX);
+  int filerow;
+  for (filerow = 0; filerow < E.buf->numrows; filerow++)
+  {
+    editorUpdateSyntax(&E.buf->row[filerow]);
+  }
+  PROF_END(PH_SYNTAX);
 }
 
-/*** find ***/
+/*** utf-8 ***/
 
-void editorFindCallback(char *query, int key)
+struct widthRange
 {
-  static int last_match = -1;
-  static int direction = 1;
-
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
+  unsigned int first, last;
+  unsigned char width;
+};
 
-  if (saved_hl)
+// Code points that are not one column wide, sorted. Zero width are combining
+// marks, variation selectors and invisible formatting; two are East Asian wide.
+static const struct widthRange widths[] = {
+    {0x0300, 0x036F, 0}, {0x0483, 0x0489, 0}, {0x0591, 0x05BD, 0}, {0x05BF, 0x05BF, 0},
+    {0x05C1, 0x05C2, 0}, {0x05C4, 0x05C5, 0}, {0x05C7, 0x05C7, 0}, {0x0610, 0x061A, 0},
+    {0x064B, 0x065F, 0}, {0x0670, 0x0670, 0}, {0x06D6, 0x06DC, 0}, {0x06DF, 0x06E4, 0},
+    {0x06E7, 0x06E8, 0}, {0x06EA, 0x06ED, 0}, {0x0900, 0x0902, 0}, {0x093A, 0x093A, 0},
+    {0x093C, 0x093C, 0}, {0x0941, 0x0948, 0}, {0x094D, 0x094D, 0}, {0x0951, 0x0957, 0},
+    {0x0E31, 0x0E31, 0}, {0x0E34, 0x0E3A, 0}, {0x0E47, 0x0E4E, 0}, {0x1100, 0x115F, 2},
+    {0x1AB0, 0x1AFF, 0}, {0x1DC0, 0x1DFF, 0}, {0x200B, 0x200F, 0}, {0x202A, 0x202E, 0},
+    {0x2060, 0x2064, 0}, {0x20D0, 0x20FF, 0}, {0x231A, 0x231B, 2}, {0x2329, 0x232A, 2},
+    {0x23E9, 0x23EC, 2}, {0x23F0, 0x23F0, 2}, {0x23F3, 0x23F3, 2}, {0x25FD, 0x25FE, 2},
+    {0x2614, 0x2615, 2}, {0x2648, 0x2653, 2}, {0x267F, 0x267F, 2}, {0x2693, 0x2693, 2},
+    {0x26A1, 0x26A1, 2}, {0x26AA, 0x26AB, 2}, {0x26BD, 0x26BE, 2}, {0x26C4, 0x26C5, 2},
+    {0x26CE, 0x26CE, 2}, {0x26D4, 0x26D4, 2}, {0x26EA, 0x26EA, 2}, {0x26F2, 0x26F3, 2},
+    {0x26F5, 0x26F5, 2}, {0x26FA, 0x26FA, 2}, {0x26FD, 0x26FD, 2}, {0x2705, 0x2705, 2},
+    {0x270A, 0x270B, 2}, {0x2728, 0x2728, 2}, {0x274C, 0x274C, 2}, {0x274E, 0x274E, 2},
+    {0x2753, 0x2755, 2}, {0x2757, 0x2757, 2}, {0x2795, 0x2797, 2}, {0x27B0, 0x27B0, 2},
+    {0x27BF, 0x27BF, 2}, {0x2B1B, 0x2B1C, 2}, {0x2B50, 0x2B50, 2}, {0x2B55, 0x2B55, 2},
+    {0x2E80, 0x303E, 2}, {0x3041, 0x3096, 2}, {0x3099, 0x309A, 0}, {0x309B, 0x33FF, 2},
+    {0x3400, 0x4DBF, 2}, {0x4E00, 0x9FFF, 2}, {0xA000, 0xA4CF, 2}, {0xA960, 0xA97F, 2},
+    {0xAC00, 0xD7A3, 2}, {0xF900, 0xFAFF, 2}, {0xFE00, 0xFE0F, 0}, {0xFE10, 0xFE19, 2},
+    {0xFE20, 0xFE2F, 0}, {0xFE30, 0xFE6F, 2}, {0xFEFF, 0xFEFF, 0}, {0xFF00, 0xFF60, 2},
+    {0xFFE0, 0xFFE6, 2}, {0x16FE0, 0x16FE4, 2}, {0x17000, 0x18CFF, 2}, {0x1B000, 0x1B2FF, 2},
+    {0x1F004, 0x1F004, 2}, {0x1F0CF, 0x1F0CF, 2}, {0x1F18E, 0x1F18E, 2}, {0x1F191, 0x1F19A, 2},
+    {0x1F200, 0x1F251, 2}, {0x1F300, 0x1F64F, 2}, {0x1F680, 0x1F6FF, 2}, {0x1F7E0, 0x1F7EB, 2},
+    {0x1F90C, 0x1F9FF, 2}, {0x1FA70, 0x1FAFF, 2}, {0x20000, 0x2FFFD, 2}, {0x30000, 0x3FFFD, 2},
+    {0xE0001, 0xE007F, 0}, {0xE0100, 0xE01EF, 0}};
+
+int charWidth(int cp)
+{
+  if (cp < 0x300)
+    return 1;
+  int lo = 0, hi = sizeof(widths) / sizeof(widths[0]) - 1;
+  while (lo <= hi)
   {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+    int mid = (lo + hi) / 2;
+    if ((unsigned int)cp < widths[mid].first)
+      hi = mid - 1;
+    else if ((unsigned int)cp > widths[mid].last)
+      lo = mid + 1;
+    else
+      return widths[mid].width;
   }
+  return 1;
+}
 
-  if (key == '\r' || key == '\x1b')
+int is_continuation(int c)
+{
+  return (c & 0xC0) == 0x80;
+}
+
+// Decodes the sequence at s into *cp and returns its length. Malformed,
+// overlong and truncated sequences decode as one byte with *cp = -1.
+int utf8Decode(const char *s, int len, int *cp)
+{
+  const unsigned char *u = (const unsigned char *)s;
+  int n = u[0] < 0x80 ? 1 : u[0] < 0xC2 ? 0 : u[0] < 0xE0 ? 2 : u[0] < 0xF0 ? 3 : u[0] < 0xF5 ? 4 : 0;
+  static const int min[] = {0, 0, 0x80, 0x800, 0x10000};
+  *cp = -1;
+  if (n == 0 || n > len)
+    return 1;
+  int c = n == 1 ? u[0] : u[0] & (0x7F >> n);
+  for (int j = 1; j < n; j++)
   {
-    last_match = -1;
-    direction = 1;
-    return;
+    if (!is_continuation(u[j]))
+      return 1;
+    c = (c << 6) | (u[j] & 0x3F);
   }
-  else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+  if (c < min[n] || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+    return 1;
+  *cp = c;
+  return n;
+}
+
+int utf8IsAscii(const char *s, int len)
+{
+  int i = 0;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= len; i += 16)
+    acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(s + i)));
+  if (_mm_movemask_epi8(acc))
+    return 0;
+#endif
+  for (; i < len; i++)
+    if (s[i] & 0x80)
+      return 0;
+  return 1;
+}
+
+// Start of the character after cx, together with any combining marks on it
+int editorRowNextChar(erow *row, int cx)
+{
+  int cp;
+  if (cx >= row->size)
+    return row->size;
+  cx += utf8Decode(&row->chars[cx], row->size - cx, &cp);
+  while (cx < row->size)
   {
-    direction = 1;
+    int n = utf8Decode(&row->chars[cx], row->size - cx, &cp);
+    if (cp < 0x300 || charWidth(cp) != 0)
+      break;
+    cx += n;
   }
-  else if (key == ARROW_LEFT || key == ARROW_UP)
+  return cx;
+}
+
+int editorRowPrevChar(erow *row, int cx)
+{
+  while (cx > 0)
   {
-    direction = -1;
+    int start = cx - 1;
+    while (start > 0 && cx - start < 4 && is_continuation(row->chars[start]))
+      start--;
+    int cp;
+    if (utf8Decode(&row->chars[start], row->size - start, &cp) != cx - start)
+      start = cx - 1; // stray continuation byte
+    cx = start;
+    if (cp < 0x300 || charWidth(cp) != 0)
+      break;
   }
-  else
+  return cx;
+}
+
+/*** word index ***/
+
+unsigned int wordEdgeHash(int node, unsigned char c)
+{
+  return ((unsigned int)node * 0x9E3779B1u) ^ (c * 0x85EBCA6Bu);
+}
+
+int wordChild(struct wordIndex *w, int node, unsigned char c, int create)
+{
+  unsigned int h = wordEdgeHash(node, c) & w->edgemask;
+  for (; w->edges[h].child; h = (h + 1) & w->edgemask)
+    if (w->edges[h].parent == node && w->edges[h].c == c)
+      return w->edges[h].child;
+  if (!create)
+    return 0;
+
+  if (w->numnodes == w->cap)
   {
-    last_match = -1;
-    direction = 1;
+    w->cap *= 2;
+    w->nodes = realloc(w->nodes, sizeof(struct trieNode) * w->cap);
   }
+  int j = w->numnodes++;
+  w->nodes[j] = (struct trieNode){node, 0, w->nodes[node].child, 0, 0, c};
+  w->nodes[node].child = j;
+  w->edges[h] = (struct trieEdge){node, j, c};
 
-  if (last_match == -1)
-    direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++)
+  if (w->numnodes * 2 > w->edgemask) // keep the table at most half full
   {
-    current += direction;
-    if (current == -1)
-      current = E.numrows - 1;
-    else if (current == E.numrows)
-      current = 0;
-
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match)
+    free(w->edges);
+    w->edgemask = w->edgemask * 2 + 1;
+    w->edges = calloc(w->edgemask + 1, sizeof(struct trieEdge));
+    for (int k = 1; k < w->numnodes; k++)
     {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
-
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+      h = wordEdgeHash(w->nodes[k].parent, w->nodes[k].c) & w->edgemask;
+      while (w->edges[h].child)
+        h = (h + 1) & w->edgemask;
+      w->edges[h] = (struct trieEdge){w->nodes[k].parent, k, w->nodes[k].c};
     }
   }
+  return j;
 }
 
-void editorFind()
+void wordIndexAdd(struct wordIndex *w, const char *s, int len, int delta)
 {
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
-
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
-                             editorFindCallback);
-
-  if (query)
+  if (w->numnodes == 0) // the root
   {
-    free(query);
+    w->cap = 1024;
+    w->nodes = malloc(sizeof(struct trieNode) * w->cap);
+    w->nodes[0] = (struct trieNode){0, 0, 0, 0, 0, 0};
+    w->numnodes = 1;
+    w->edgemask = 2047;
+    w->edges = calloc(w->edgemask + 1, sizeof(struct trieEdge));
   }
-  else
+
+  int node = 0;
+  for (int j = 0; j < len; j++)
+    node = wordChild(w, node, s[j], 1);
+  int count = (w->nodes[node].count += delta);
+
+  // Update best up towards the root, ancestors are unchanged once a node is
+  for (;;)
   {
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+    struct trieNode *n = &w->nodes[node];
+    int best = count;
+    if (delta > 0)
+    {
+      if (n->best >= count)
+        break;
+    }
+    else
+    {
+      best = n->count;
+      for (int c = n->child; c; c = w->nodes[c].next)
+        if (w->nodes[c].best > best)
+          best = w->nodes[c].best;
+      if (best == n->best)
+        break;
+    }
+    n->best = best;
+    if (node == 0)
+      break;
+    node = n->parent;
   }
 }
 
-/*** append buffer ***/
-
-struct abuf
+// Counts (delta 1) or uncounts (delta -1) the identifiers in a row
+void wordIndexRow(struct wordIndex *w, erow *row, int delta)
 {
-  char *b;
-  int len;
-};
-
-#define ABUF_INIT \
-  {               \
-    NULL, 0       \
+  if (!w->built || row->render == NULL)
+    return;
+  int i = 0;
+  while (i < row->rsize)
+  {
+    if (!is_word_byte(row->render[i]))
+    {
+      i++;
+      continue;
+    }
+    int len = syntaxWordRun(&row->render[i], row->rsize - i);
+    if (len >= 2 && !isdigit((unsigned char)row->render[i]))
+      wordIndexAdd(w, &row->render[i], len, delta);
+    i += len;
   }
+}
 
-void abAppend(struct abuf *ab, const char *s, int len)
+void wordIndexBuild(struct editorBuffer *b)
 {
-  char *new = realloc(ab->b, ab->len + len);
-
-  if (new == NULL)
+  if (b->words.built)
     return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+  b->words.built = 1;
+  for (int j = 0; j < b->numrows; j++)
+    wordIndexRow(&b->words, &b->row[j], 1);
 }
 
-void abFree(struct abuf *ab)
+// Max-heap of subtrees ranked by best and of words ranked by count
+struct wordEntry
 {
-  free(ab->b);
-}
-
-/*** output ***/
+  int node, prio, word;
+};
 
-void editorScroll()
+struct wordHeap
 {
-  E.rx = 0;
-  if (E.cy < E.numrows)
-  {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
-  }
+  struct wordEntry *e;
+  int size, cap;
+};
 
-  if (E.cy < E.rowoff)
+void wordHeapPush(struct wordHeap *h, int node, int prio, int word)
+{
+  if (h->size == h->cap)
   {
-    E.rowoff = E.cy;
+    h->cap = h->cap ? h->cap * 2 : 64;
+    h->e = realloc(h->e, sizeof(struct wordEntry) * h->cap);
   }
-  if (E.cy >= E.rowoff + E.screenrows)
+  int at = h->size++;
+  while (at && h->e[(at - 1) / 2].prio < prio)
   {
-    E.rowoff = E.cy - E.screenrows + 1;
+    h->e[at] = h->e[(at - 1) / 2];
+    at = (at - 1) / 2;
   }
-  if (E.rx < E.coloff)
+  h->e[at] = (struct wordEntry){node, prio, word};
+}
+
+struct wordEntry wordHeapPop(struct wordHeap *h)
+{
+  struct wordEntry top = h->e[0];
+  struct wordEntry last = h->e[--h->size];
+  int at = 0;
+  while (2 * at + 1 < h->size)
   {
-    E.coloff = E.rx;
+    int child = 2 * at + 1;
+    if (child + 1 < h->size && h->e[child + 1].prio > h->e[child].prio)
+      child++;
+    if (h->e[child].prio <= last.prio)
+      break;
+    h->e[at] = h->e[child];
+    at = child;
   }
-  if (E.rx >= E.coloff + E.screencols)
+  h->e[at] = last;
+  return top;
+}
+
+// Fills out with up to k of the most frequent words that start with prefix
+// and are longer than it, most frequent first. Returns how many were found.
+int wordIndexComplete(struct wordIndex *w, const char *prefix, int len, char **out, int k)
+{
+  int node = 0;
+  for (int j = 0; j < len && w->numnodes; j++)
+    if (!(node = wordChild(w, node, prefix[j], 0)))
+      return 0;
+  if (w->numnodes == 0)
+    return 0;
+
+  struct wordHeap h = {NULL, 0, 0};
+  int found = 0;
+  for (int c = w->nodes[node].child; c; c = w->nodes[c].next)
+    if (w->nodes[c].best > 0)
+      wordHeapPush(&h, c, w->nodes[c].best, 0);
+
+  while (h.size && found < k)
   {
-    E.coloff = E.rx - E.screencols + 1;
+    struct wordEntry top = wordHeapPop(&h);
+    struct trieNode *n = &w->nodes[top.node];
+    if (top.word) // no subtree left in the heap ranks above it
+    {
+      int depth = 0;
+      for (int j = top.node; j; j = w->nodes[j].parent)
+        depth++;
+      char *word = malloc(depth + 1);
+      word[depth] = '\0';
+      for (int j = top.node; j; j = w->nodes[j].parent)
+        word[--depth] = w->nodes[j].c;
+      out[found++] = word;
+      continue;
+    }
+    if (n->count > 0)
+      wordHeapPush(&h, top.node, n->count, 1);
+    for (int c = n->child; c; c = w->nodes[c].next)
+      if (w->nodes[c].best > 0)
+        wordHeapPush(&h, c, w->nodes[c].best, 0);
   }
+  free(h.e);
+  return found;
 }
 
-void editorDrawRows(struct abuf *ab)
+/*** soft wrap ***/
+
+// Screen lines row takes at width. Rows with multi-byte characters keep
+// where each line starts, plain ASCII rows break every width bytes.
+int editorRowWrap(erow *row, int width)
 {
-  int y;
-  for (y = 0; y < E.screenrows; y++)
+  if (row->wrapw == width)
+    return row->nwrap;
+  row->wrapw = width;
+  if (row->cw == NULL)
   {
-    int filerow = y + E.rowoff;
-    if (filerow >= E.numrows)
+    row->nwrap = row->rsize ? (row->rsize + width - 1) / width : 1;
+    return row->nwrap;
+  }
+
+  for (int pass = 0; pass < 2; pass++) // count, then fill
+  {
+    int n = 1, col = 0;
+    for (int j = 0; j < row->rsize; j++)
     {
-      if (E.numrows == 0 && y == E.screenrows / 3)
+      if (col + row->cw[j] > width && col > 0)
       {
-        char welcome[80];
-        int welcomelen = snprintf(welcome, sizeof(welcome),
-                                  "Simplified Editor Extended -- version %s", SEX_VERSION);
-        if (welcomelen > E.screencols)
-          welcomelen = E.screencols;
-        int padding = (E.screencols - welcomelen) / 2;
-        if (padding)
-        {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-        while (padding--)
-          abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
-      }
-      else
-      {
-        abAppend(ab, "~", 1);
+        if (pass)
+          row->wrap[n - 1] = j;
+        n++;
+        col = 0;
       }
+      col += row->cw[j];
+    }
+    if (!pass)
+      row->wrap = realloc(row->wrap, sizeof(int) * n);
+    row->nwrap = n;
+  }
+  return row->nwrap;
+}
+
+// Render index where screen line k of the row starts
+int editorRowWrapStart(erow *row, int k, int width)
+{
+  if (k == 0)
+    return 0;
+  return row->cw ? row->wrap[k - 1] : k * width;
+}
+
+// Screen line of the row that render index rx is on
+int editorRowWrapLine(erow *row, int rx, int width)
+{
+  int n = editorRowWrap(row, width);
+  int k = 0;
+  if (row->cw == NULL)
+    k = rx / width;
+  else
+    while (k + 1 < n && row->wrap[k] <= rx)
+      k++;
+  return k < n ? k : n - 1;
+}
+
+// Recomputes the tree nodes from s on from nwrap. Nodes before s keep their
+// sums, the ones on the path down to s - 1 are the only ones reaching past it.
+void editorWrapTreeFrom(struct wrapIndex *w, int s)
+{
+  for (int i = s; i <= w->n; i++)
+    w->tree[i] = w->nwrap[i - 1];
+  for (int i = s - 1; i > 0; i -= i & -i)
+    if (i + (i & -i) <= w->n)
+      w->tree[i + (i & -i)] += w->tree[i];
+  for (int i = s; i <= w->n; i++)
+    if (i + (i & -i) <= w->n)
+      w->tree[i + (i & -i)] += w->tree[i];
+}
+
+void editorWrapReserve(struct wrapIndex *w, int n)
+{
+  if (n <= w->cap && w->tree)
+    return;
+  while (w->cap < n || !w->cap)
+    w->cap = w->cap ? w->cap * 2 : 64;
+  w->nwrap = realloc(w->nwrap, sizeof(int) * w->cap);
+  w->tree = realloc(w->tree, sizeof(int) * (w->cap + 1));
+}
+
+// The wrap index of b at width, built if the buffer has none for it yet
+struct wrapIndex *editorWrapBuild(struct editorBuffer *b, int width)
+{
+  static unsigned int clock = 0;
+  struct wrapIndex *w = &b->wraps[0];
+  for (int j = 0; j < SEX_WRAP_WIDTHS; j++)
+  {
+    if (b->wraps[j].width == width)
+    {
+      b->wraps[j].used = ++clock;
+      return &b->wraps[j];
+    }
+    if (b->wraps[j].used < w->used)
+      w = &b->wraps[j];
+  }
+
+  w->width = width;
+  w->used = ++clock;
+  w->n = b->numrows;
+  editorWrapReserve(w, w->n);
+  for (int i = 0; i < w->n; i++)
+    w->nwrap[i] = editorRowWrap(&b->row[i], width);
+  editorWrapTreeFrom(w, 1);
+  return w;
+}
+
+void editorWrapAdd(struct wrapIndex *w, int r, int delta)
+{
+  w->nwrap[r] += delta;
+  for (int i = r + 1; i <= w->n && delta; i += i & -i)
+    w->tree[i] += delta;
+}
+
+// Keeps the wrap indexes in step when rows at..at+del become n rows. The new
+// rows count no lines until editorUpdateRow adds theirs.
+void editorWrapSplice(struct editorBuffer *b, int at, int del, int n)
+{
+  for (int j = 0; j < SEX_WRAP_WIDTHS; j++)
+  {
+    struct wrapIndex *w = &b->wraps[j];
+    if (w->width == 0)
+      continue;
+    editorWrapReserve(w, w->n - del + n);
+    memmove(&w->nwrap[at + n], &w->nwrap[at + del], sizeof(int) * (w->n - at - del));
+    memset(&w->nwrap[at], 0, sizeof(int) * n);
+    w->n += n - del;
+    editorWrapTreeFrom(w, at + 1);
+  }
+}
+
+void editorWrapFree(struct editorBuffer *b)
+{
+  for (int j = 0; j < SEX_WRAP_WIDTHS; j++)
+  {
+    free(b->wraps[j].nwrap);
+    free(b->wraps[j].tree);
+  }
+  memset(b->wraps, 0, sizeof(b->wraps));
+}
+
+// Screen lines taken by the rows before row r
+int editorWrapPrefix(struct wrapIndex *w, int r)
+{
+  int sum = 0;
+  for (int i = r < w->n ? r : w->n; i > 0; i -= i & -i)
+    sum += w->tree[i];
+  return sum;
+}
+
+// Row that screen line 'line' belongs to, and which of its lines it is
+int editorWrapFind(struct wrapIndex *w, int line, int *sub)
+{
+  int pos = 0, step = 1;
+  while (step * 2 <= w->n)
+    step *= 2;
+  for (; step; step /= 2)
+  {
+    if (pos + step <= w->n && w->tree[pos + step] <= line)
+    {
+      pos += step;
+      line -= w->tree[pos];
+    }
+  }
+  *sub = line;
+  return pos;
+}
+
+/*** undo ***/
+
+// Adds a holder to shared chars, the first holder is counted on first share
+int *editorShare(int **refs)
+{
+  if (*refs == NULL)
+  {
+    *refs = malloc(sizeof(int));
+    **refs = 1;
+  }
+  ++**refs;
+  return *refs;
+}
+
+// Drops a holder of chars, the last one frees them
+void editorRelease(char *chars, int *refs)
+{
+  if (refs && --*refs > 0)
+    return;
+  free(refs);
+  free(chars);
+}
+
+struct undoEntry *editorJournal(int type, int at, int n)
+{
+  struct editorBuffer *b = E.buf;
+  if (b->numundo == b->undocap)
+  {
+    b->undocap = b->undocap ? b->undocap * 2 : 64;
+    b->undo = realloc(b->undo, sizeof(struct undoEntry) * b->undocap);
+  }
+  struct undoEntry *u = &b->undo[b->numundo++];
+  u->type = type;
+  u->group = E.undogroup;
+  u->at = at;
+  u->n = n;
+  u->lines = NULL;
+  u->cx = E.undocx;
+  u->cy = E.undocy;
+  return u;
+}
+
+// The last entry if it belongs to the group being recorded
+struct undoEntry *editorJournalLast()
+{
+  struct editorBuffer *b = E.buf;
+  if (b->numundo == 0 || b->undo[b->numundo - 1].group != E.undogroup)
+    return NULL;
+  return &b->undo[b->numundo - 1];
+}
+
+void editorJournalLines(struct undoEntry *u)
+{
+  u->lines = malloc(sizeof(struct clipLine) * u->n);
+  for (int j = 0; j < u->n; j++)
+  {
+    erow *row = &E.buf->row[u->at + j];
+    u->lines[j].chars = row->chars;
+    u->lines[j].size = row->size;
+    u->lines[j].refs = editorShare(&row->refs);
+  }
+}
+
+// Keeps what row holds before its chars change. Only the first change to a
+// row in a group is kept, which is all undo needs.
+void editorJournalRow(erow *row)
+{
+  if (!E.journal)
+    return;
+  struct undoEntry *last = editorJournalLast();
+  if (last && last->type == UNDO_ROW && last->at == row->idx)
+    return;
+  editorJournalLines(editorJournal(UNDO_ROW, row->idx, 1));
+}
+
+void editorJournalInsert(int at, int n)
+{
+  if (!E.journal || n == 0)
+    return;
+  struct undoEntry *last = editorJournalLast();
+  if (last && last->type == UNDO_INSERT && last->at + last->n == at)
+    last->n += n; // loading or pasting line by line
+  else
+    editorJournal(UNDO_INSERT, at, n);
+}
+
+void editorJournalDelete(int at, int n)
+{
+  if (!E.journal || n == 0)
+    return;
+  editorJournalLines(editorJournal(UNDO_DELETE, at, n));
+}
+
+void editorUndoFree(struct editorBuffer *b)
+{
+  for (int j = 0; j < b->numundo; j++)
+  {
+    struct undoEntry *u = &b->undo[j];
+    for (int k = 0; u->lines && k < u->n; k++)
+      editorRelease(u->lines[k].chars, u->lines[k].refs);
+    free(u->lines);
+  }
+  free(b->undo);
+  b->undo = NULL;
+  b->numundo = b->undocap = 0;
+}
+
+// Keys that insert themselves, as opposed to commands
+int editorIsTyped(int c)
+{
+  return c == '\t' || (c >= ' ' && c < 256 && c != BACKSPACE);
+}
+
+// Starts the undo group of key c. A run of typing on one row stays one group,
+// and so does everything a macro does.
+void editorUndoBegin(int c)
+{
+  static int typing = 0;
+  E.journal = 1;
+  if (E.replaying)
+    return;
+  if (!(typing && editorIsTyped(c) && E.cy == E.undocy))
+  {
+    E.undogroup++;
+    E.undocx = E.cx;
+    E.undocy = E.cy;
+  }
+  typing = editorIsTyped(c);
+}
+
+// Gives row chars of its own before they are changed in place, once the
+// journal has kept the old ones
+void editorRowOwn(erow *row)
+{
+  editorJournalRow(row);
+  if (row->refs == NULL)
+    return;
+  if (*row->refs > 1)
+  {
+    char *chars = malloc(row->size + 1);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    (*row->refs)--;
+    row->chars = chars;
+  }
+  else
+    free(row->refs);
+  row->refs = NULL;
+}
+
+/*** row operations ***/
+
+int editorRowCxToRx(erow *row, int cx)
+{
+  if (row->tabs == 0)
+    return cx;
+  int rx = 0, col = 0;
+  int j;
+  for (j = 0; j < cx; j++)
+  {
+    if (row->chars[j] == '\t')
+    {
+      rx += SEX_TAB_STOP - (col % SEX_TAB_STOP);
+      col += SEX_TAB_STOP - (col % SEX_TAB_STOP);
     }
     else
     {
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0)
-        len = 0;
-      if (len > E.screencols)
-        len = E.screencols;
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
-      int j;
-      for (j = 0; j < len; j++)
+      col += row->cw ? row->cw[rx] : 1;
+      rx++;
+    }
+  }
+  return rx;
+}
+
+// Screen column of render index rx
+int editorRowRxToCol(erow *row, int rx)
+{
+  if (row->cw == NULL)
+    return rx;
+  int col = 0;
+  for (int j = 0; j < rx && j < row->rsize; j++)
+    col += row->cw[j];
+  return col + (rx > row->rsize ? rx - row->rsize : 0);
+}
+
+int editorRowRxToCx(erow *row, int rx)
+{
+  if (row->tabs == 0)
+    return rx < row->size ? rx : row->size;
+  int cur_rx = 0, col = 0;
+  int cx;
+  for (cx = 0; cx < row->size; cx++)
+  {
+    if (row->chars[cx] == '\t')
+    {
+      cur_rx += SEX_TAB_STOP - (col % SEX_TAB_STOP);
+      col += SEX_TAB_STOP - (col % SEX_TAB_STOP);
+    }
+    else
+    {
+      col += row->cw ? row->cw[cur_rx] : 1;
+      cur_rx++;
+    }
+
+    if (cur_rx > rx)
+      return cx;
+  }
+  return cx;
+}
+
+void editorUpdateRow(erow *row)
+{
+  wordIndexRow(&E.buf->words, row, -1); // what the row said before the edit
+
+  int tabs = 0;
+  int j;
+  for (j = 0; j < row->size; j++)
+    if (row->chars[j] == '\t')
+      tabs++;
+  row->tabs = tabs;
+
+  free(row->render);
+  row->render = malloc(row->size + tabs * (SEX_TAB_STOP - 1) + 1);
+  free(row->cw);
+  row->cw = utf8IsAscii(row->chars, row->size) ? NULL : malloc(row->size + tabs * (SEX_TAB_STOP - 1));
+
+  int idx = 0, col = 0; // tab stops are screen columns
+  j = 0;
+  while (j < row->size)
+  {
+    if (row->chars[j] == '\t')
+    {
+      do
       {
-        if (iscntrl(c[j]))
-        {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1)
-          {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        }
-        else if (hl[j] == HL_NORMAL)
-        {
-          if (current_color != -1)
-          {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        }
-        else
-        {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color)
-          {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
-        }
-      }
-      abAppend(ab, "\x1b[39m", 5);
+        if (row->cw)
+          row->cw[idx] = 1;
+        row->render[idx++] = ' ';
+      } while (++col % SEX_TAB_STOP != 0);
+      j++;
+    }
+    else if (row->cw == NULL)
+    {
+      row->render[idx++] = row->chars[j++];
+      col++;
+    }
+    else // malformed bytes are shown as one '?' each
+    {
+      int cp;
+      int n = utf8Decode(&row->chars[j], row->size - j, &cp);
+      int w = cp == -1 ? 1 : charWidth(cp);
+      row->cw[idx] = w;
+      memset(&row->cw[idx + 1], 0, n - 1);
+      memcpy(&row->render[idx], &row->chars[j], n);
+      idx += n;
+      j += n;
+      col += w;
     }
+  }
+  row->render[idx] = '\0';
+  row->rsize = idx;
+  wordIndexRow(&E.buf->words, row, 1);
 
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+  // Keep the wrap indexes in step, at each width they are kept for
+  row->wrapw = 0;
+  for (int k = 0; k < SEX_WRAP_WIDTHS; k++)
+  {
+    struct wrapIndex *w = &E.buf->wraps[k];
+    if (w->width && row->idx < w->n)
+      editorWrapAdd(w, row->idx, editorRowWrap(row, w->width) - w->nwrap[row->idx]);
   }
+
+  PROF_BEGIN(PH_SYNTAX);
+  editorRowSyntax(row);
+  PROF_END(PH_SYNTAX);
 }
 
-void editorDrawStatusBar(struct abuf *ab)
+void editorInsertRow(int at, char *s, size_t len)
 {
-  abAppend(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                     E.filename ? E.filename : "[No Name]", E.numrows,
-                     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-                      E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
-  if (len > E.screencols)
-    len = E.screencols;
-  abAppend(ab, status, len);
-  while (len < E.screencols)
+  if (at < 0 || at > E.buf->numrows)
+    return;
+  editorJournalInsert(at, 1);
+  editorSyntaxShift(at, 0, 1);
+  editorWrapSplice(E.buf, at, 0, 1);
+  E.buf->brok = 0;
+
+  if (E.buf->numrows == E.buf->rowcap)
+  {
+    E.buf->rowcap = E.buf->rowcap ? E.buf->rowcap * 2 : 64;
+    E.buf->row = realloc(E.buf->row, sizeof(erow) * E.buf->rowcap);
+  }
+  memmove(&E.buf->row[at + 1], &E.buf->row[at], sizeof(erow) * (E.buf->numrows - at));
+  for (int j = at + 1; j <= E.buf->numrows; j++)
+    E.buf->row[j].idx++;
+
+  E.buf->row[at].idx = at;
+
+  E.buf->row[at].size = len;
+  E.buf->row[at].chars = malloc(len + 1);
+  memcpy(E.buf->row[at].chars, s, len);
+  E.buf->row[at].chars[len] = '\0';
+
+  E.buf->row[at].rsize = 0;
+  E.buf->row[at].render = NULL;
+  E.buf->row[at].hl = NULL;
+  E.buf->row[at].cw = NULL;
+  E.buf->row[at].wrapw = 0;
+  E.buf->row[at].wrap = NULL;
+  // What the row below was highlighted after, so a change flows on to it
+  E.buf->row[at].hl_open_comment = at > 0 && E.buf->row[at - 1].hl_open_comment;
+  E.buf->row[at].bclose = E.buf->row[at].bopen = 0;
+  E.buf->row[at].refs = NULL;
+  E.buf->row[at].hlstale = 0;
+  E.buf->numrows++;
+  editorUpdateRow(&E.buf->row[at]);
+  E.buf->dirty++;
+}
+
+void editorFreeRow(erow *row)
+{
+  wordIndexRow(&E.buf->words, row, -1);
+  free(row->render);
+  editorRelease(row->chars, row->refs);
+  free(row->hl);
+  free(row->cw);
+  free(row->wrap);
+}
+
+void editorDelRow(int at)
+{
+  if (at < 0 || at >= E.buf->numrows)
+    return;
+  editorJournalDelete(at, 1);
+  editorSyntaxShift(at, 1, 0);
+  int open = E.buf->row[at].hl_open_comment; // what the row below was highlighted after
+  editorFreeRow(&E.buf->row[at]);
+  memmove(&E.buf->row[at], &E.buf->row[at + 1], sizeof(erow) * (E.buf->numrows - at - 1));
+  for (int j = at; j < E.buf->numrows - 1; j++)
+    E.buf->row[j].idx--;
+  E.buf->numrows--;
+  editorWrapSplice(E.buf, at, 1, 0);
+  E.buf->brok = 0;
+  if (at < E.buf->numrows && open != (at > 0 && E.buf->row[at - 1].hl_open_comment))
+    editorRowSyntax(&E.buf->row[at]);
+  E.buf->version++;
+  E.buf->dirty++;
+}
+
+// Replaces del rows at at by n lines. With refs the new rows share each line
+// with its holders, whom the caller has already counted them among.
+void editorReplaceRows(int at, int del, char **lines, size_t *lens, int **refs, int n)
+{
+  if (at < 0 || del < 0 || at + del > E.buf->numrows)
+    return;
+  editorJournalDelete(at, del);
+  editorJournalInsert(at, n);
+  editorSyntaxShift(at, del, n);
+  editorWrapSplice(E.buf, at, del, n);
+  E.buf->brok = 0;
+
+  // What the row after the replaced ones was highlighted after
+  int open = at + del > 0 && E.buf->row[at + del - 1].hl_open_comment;
+  for (int j = at; j < at + del; j++)
+    editorFreeRow(&E.buf->row[j]);
+
+  int numrows = E.buf->numrows - del + n;
+  if (numrows > E.buf->rowcap)
+  {
+    while (E.buf->rowcap < numrows)
+      E.buf->rowcap = E.buf->rowcap ? E.buf->rowcap * 2 : 64;
+    E.buf->row = realloc(E.buf->row, sizeof(erow) * E.buf->rowcap);
+  }
+  memmove(&E.buf->row[at + n], &E.buf->row[at + del], sizeof(erow) * (E.buf->numrows - at - del));
+  E.buf->numrows = numrows;
+  for (int j = at + n; j < E.buf->numrows; j++)
+    E.buf->row[j].idx = j;
+
+  for (int j = at; j < at + n; j++)
   {
-    if (E.screencols - len == rlen)
+    erow *row = &E.buf->row[j];
+    row->idx = j;
+    row->size = lens[j - at];
+    row->refs = refs ? refs[j - at] : NULL;
+    if (refs)
     {
-      abAppend(ab, rstatus, rlen);
-      break;
+      row->chars = lines[j - at];
     }
     else
     {
-      abAppend(ab, " ", 1);
-      len++;
+      row->chars = malloc(row->size + 1);
+      memcpy(row->chars, lines[j - at], row->size);
+      row->chars[row->size] = '\0';
     }
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->cw = NULL;
+    row->wrapw = 0;
+    row->wrap = NULL;
+    row->hl_open_comment = open; // a change at the last flows on from there
+    row->bclose = row->bopen = 0;
+    row->hlstale = 0;
   }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
+  for (int j = at; j < at + n; j++)
+    editorUpdateRow(&E.buf->row[j]);
+  if (n == 0 && at < E.buf->numrows && open != (at > 0 && E.buf->row[at - 1].hl_open_comment))
+    editorRowSyntax(&E.buf->row[at]); // rows after the cut may now start in a comment
+
+  E.buf->version++;
+  E.buf->dirty++;
 }
 
-void editorDrawMessageBar(struct abuf *ab)
+void editorRowInsertChar(erow *row, int at, int c)
 {
-  abAppend(ab, "\x1b[K", 3);
-  int msglen = strlen(E.statusmsg);
-  if (msglen > E.screencols)
-    msglen = E.screencols;
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+  if (at < 0 || at > row->size)
+    at = row->size;
+  editorRowOwn(row);
+  row->chars = realloc(row->chars, row->size + 2);
+  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  row->size++;
+  row->chars[at] = c;
+  editorUpdateRow(row);
+  E.buf->dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len)
+{
+  if (at < 0 || at > row->size)
+    at = row->size;
+  editorRowOwn(row);
+  row->chars = realloc(row->chars, row->size + len + 1);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  editorUpdateRow(row);
+  E.buf->dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len)
+{
+  editorRowOwn(row);
+  row->chars = realloc(row->chars, row->size + len + 1);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  E.buf->dirty++;
+}
+
+void editorRowDelChar(erow *row, int at, int len)
+{
+  if (at < 0 || at + len > row->size)
+    return;
+  editorRowOwn(row);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  editorUpdateRow(row);
+  E.buf->dirty++;
+}
+
+/*** editor operations ***/
+
+// Puts the cursor at the start of line (1-based) with the line mid-screen.
+// Rows are indexed by number, so this costs the same anywhere in the file.
+void editorJumpToLine(long line)
+{
+  if (line > E.buf->numrows)
+    line = E.buf->numrows;
+  if (line < 1)
+    line = 1;
+  E.cy = E.buf->numrows ? line - 1 : 0;
+  E.cx = 0;
+  E.rowoff = E.cy > E.screenrows / 2 ? E.cy - E.screenrows / 2 : 0;
+}
+
+void editorInsertChar(int c)
+{
+  if (E.cy == E.buf->numrows)
+  {
+    editorInsertRow(E.buf->numrows, "", 0);
+  }
+  editorRowInsertChar(&E.buf->row[E.cy], E.cx, c);
+  E.cx++;
+}
+
+// Completes the identifier left of the cursor with the most frequent words
+// in the buffer. Pressed again right away, swaps in the next candidate.
+void editorComplete()
+{
+  static char *cands[SEX_COMPLETIONS];
+  static int ncands = 0, next = 0, prefixlen = 0, inserted = 0;
+  static struct editorBuffer *buf = NULL;
+  static int cy = -1, cx = -1;
+  static unsigned int version = 0;
+
+  if (E.cy >= E.buf->numrows)
+    return;
+  erow *row = &E.buf->row[E.cy];
+
+  if (ncands && E.buf == buf && E.cy == cy && E.cx == cx && E.buf->version == version)
+  {
+    editorRowDelChar(row, E.cx - inserted, inserted);
+    E.cx -= inserted;
+    next = (next + 1) % ncands;
+  }
+  else
+  {
+    for (int j = 0; j < ncands; j++)
+      free(cands[j]);
+    ncands = next = 0;
+
+    int start = E.cx;
+    while (start > 0 && is_word_byte(row->chars[start - 1]))
+      start--;
+    if (start == E.cx)
+      return;
+    wordIndexBuild(E.buf);
+    prefixlen = E.cx - start;
+    ncands = wordIndexComplete(&E.buf->words, &row->chars[start], prefixlen, cands, SEX_COMPLETIONS);
+    if (ncands == 0)
+    {
+      editorSetStatusMessage("No completions");
+      return;
+    }
+  }
+
+  inserted = strlen(cands[next]) - prefixlen;
+  editorRowInsertString(row, E.cx, cands[next] + prefixlen, inserted);
+  E.cx += inserted;
+  buf = E.buf;
+  cy = E.cy;
+  cx = E.cx;
+  version = E.buf->version;
+
+  char msg[80];
+  int len = snprintf(msg, sizeof(msg), "[%d/%d]", next + 1, ncands);
+  for (int j = 0; j < ncands && len < (int)sizeof(msg); j++)
+    len += snprintf(msg + len, sizeof(msg) - len, " %s", cands[(next + j) % ncands]);
+  editorSetStatusMessage("%s", msg);
+}
+
+// Typing an opening bracket closes it too when nothing but space or a closer
+// follows, typing a closer where its twin already stands steps over it
+void editorTypeChar(int c)
+{
+  erow *row = E.cy < E.buf->numrows ? &E.buf->row[E.cy] : NULL;
+  int next = row && E.cx < row->size ? (unsigned char)row->chars[E.cx] : 0;
+  int kind = c > 0 && c < 256 ? bracketKind[c] : 0;
+  int mrow, mrx;
+  if (kind < 0 && next == c && editorMatchBracket(E.cy, editorRowCxToRx(row, E.cx), &mrow, &mrx))
+  {
+    E.cx++;
+    return;
+  }
+
+  editorInsertChar(c);
+  row = &E.buf->row[E.cy];
+  if (kind > 0)
+    editorFlushSyntax();
+  if (kind > 0 && (next == 0 || next == ' ' || next == '\t' || bracketKind[next] < 0) &&
+      bracketAt(row, editorRowCxToRx(row, E.cx - 1)))
+    editorRowInsertChar(row, E.cx, c == '(' ? ')' : c + 2); // [] and {} are two apart
+}
+
+// Backspace between an empty pair takes the closer with the opener
+void editorDelPair()
+{
+  if (E.cy >= E.buf->numrows || E.cx == 0)
+    return;
+  erow *row = &E.buf->row[E.cy];
+  int open = (unsigned char)row->chars[E.cx - 1];
+  if (E.cx < row->size && bracketKind[open] > 0 &&
+      row->chars[E.cx] == (open == '(' ? ')' : open + 2))
+    editorRowDelChar(row, E.cx, 1);
+}
+
+void editorInsertNewline()
+{
+  if (E.cx == 0)
+  {
+    editorInsertRow(E.cy, "", 0);
+    E.cy++;
+    return;
+  }
+
+  // New lines line up with the line of the innermost bracket left open, one
+  // level deeper unless they start by closing it
+  erow *row = &E.buf->row[E.cy];
+  int rx = editorRowCxToRx(row, E.cx);
+  int r = E.cy, orx = -1;
+  int open = editorFindBracket(E.cy, rx - 1, -1, 1, &r, &orx);
+  int rest = E.cx;
+  while (rest < row->size && (row->chars[rest] == ' ' || row->chars[rest] == '\t'))
+    rest++;
+  int closer = open && rest < row->size && bracketKind[(unsigned char)row->chars[rest]] < 0;
+
+  char indent[128 + SEX_INDENT];
+  erow *from = &E.buf->row[r];
+  int base = 0;
+  while (base < from->size && base < 128 && (from->chars[base] == ' ' || from->chars[base] == '\t'))
+    base++;
+  memcpy(indent, from->chars, base);
+  int len = base;
+  if (open)
+  {
+    if (memchr(indent, '\t', base))
+      indent[len++] = '\t';
+    else
+      for (int j = 0; j < SEX_INDENT; j++)
+        indent[len++] = ' ';
+  }
+
+  int keep = closer ? base : len, tail = row->size - rest;
+  char *line = malloc(keep + tail + 1);
+  memcpy(line, indent, keep);
+  memcpy(line + keep, &row->chars[rest], tail);
+  editorInsertRow(E.cy + 1, line, keep + tail);
+  free(line);
+  if (closer && r == E.cy && orx == rx - 1) // between an empty pair, open a line inside it
+    editorInsertRow(E.cy + 1, indent, len);
+  else
+    len = keep;
+
+  row = &E.buf->row[E.cy];
+  editorRowOwn(row);
+  row->size = E.cx;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  E.cy++;
+  E.cx = len;
+}
+
+void editorDelChar()
+{
+  if (E.cy == E.buf->numrows)
+    return;
+  if (E.cx == 0 && E.cy == 0)
+    return;
+
+  erow *row = &E.buf->row[E.cy];
+  if (E.cx > 0)
+  {
+    int at = editorRowPrevChar(row, E.cx); // the whole character with its marks
+    editorRowDelChar(row, at, E.cx - at);
+    E.cx = at;
+  }
+  else
+  {
+    E.cx = E.buf->row[E.cy - 1].size;
+    editorRowAppendString(&E.buf->row[E.cy - 1], row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+
+// Takes back the last group of edits in the buffer, a key, a run of typing
+// or a whole macro run, and puts the cursor where it was before them
+void editorUndo()
+{
+  struct editorBuffer *b = E.buf;
+  if (b->numundo == 0)
+  {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  if (!editorCheckWritable())
+    return;
+  E.journal = 0;
+  int group = b->undo[b->numundo - 1].group;
+  while (b->numundo && b->undo[b->numundo - 1].group == group)
+  {
+    struct undoEntry *u = &b->undo[--b->numundo];
+    if (u->type == UNDO_INSERT)
+    {
+      editorReplaceRows(u->at, u->n, NULL, NULL, NULL, 0);
+    }
+    else // the saved lines go back into rows as they are
+    {
+      char **lines = malloc(sizeof(char *) * u->n);
+      size_t *lens = malloc(sizeof(size_t) * u->n);
+      int **refs = malloc(sizeof(int *) * u->n);
+      for (int j = 0; j < u->n; j++)
+      {
+        lines[j] = u->lines[j].chars;
+        lens[j] = u->lines[j].size;
+        refs[j] = u->lines[j].refs;
+      }
+      editorReplaceRows(u->at, u->type == UNDO_ROW, lines, lens, refs, u->n);
+      free(lines);
+      free(lens);
+      free(refs);
+      free(u->lines);
+    }
+    E.cx = u->cx;
+    E.cy = u->cy;
+  }
+  E.journal = 1;
+}
+
+void editorSetMark()
+{
+  E.buf->mark = 1;
+  E.buf->markcx = E.cx;
+  E.buf->markcy = E.cy;
+  editorSetStatusMessage("Mark set");
+}
+
+// Puts a cursor on every row from the mark to the cursor, in the cursor's column
+void editorColumnCursors()
+{
+  if (!E.buf->mark || E.buf->numrows == 0)
+  {
+    editorSetStatusMessage("No mark set");
+    return;
+  }
+  if (E.cy >= E.buf->numrows)
+    E.cy = E.buf->numrows - 1;
+  int from = E.buf->markcy < E.cy ? E.buf->markcy : E.cy;
+  int to = E.buf->markcy < E.cy ? E.cy : E.buf->markcy;
+  if (to >= E.buf->numrows)
+    to = E.buf->numrows - 1;
+  int rx = editorRowCxToRx(&E.buf->row[E.cy], E.cx);
+
+  E.numcursors = to - from + 1;
+  E.cursors = realloc(E.cursors, sizeof(struct editorCursor) * E.numcursors);
+  for (int y = from; y <= to; y++)
+  {
+    E.cursors[y - from].cy = y;
+    E.cursors[y - from].cx = editorRowRxToCx(&E.buf->row[y], rx);
+  }
+  E.cx = E.cursors[E.cy - from].cx;
+  E.buf->mark = 0;
+  editorSetStatusMessage("%d cursors, Esc to leave", E.numcursors);
+}
+
+// Render index of the extra cursor on row, -1 if it has none
+int editorCursorRx(erow *row)
+{
+  if (E.numcursors == 0 || row->idx >= E.buf->numrows || row != &E.buf->row[row->idx] ||
+      row->idx == E.cy) // the terminal's cursor shows that one
+    return -1;
+  int lo = 0, hi = E.numcursors;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (E.cursors[mid].cy < row->idx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == E.numcursors || E.cursors[lo].cy != row->idx)
+    return -1;
+  return editorRowCxToRx(row, E.cursors[lo].cx);
+}
+
+// Applies a keystroke at every cursor. The rows are edited first and then
+// rebuilt, once each, going down the buffer. Returns 0 for keys that leave
+// multiple cursors, which are then processed as usual.
+int editorCursorsKey(int c)
+{
+  int insert = editorIsTyped(c);
+  int del = c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY;
+  int move = c == ARROW_LEFT || c == ARROW_RIGHT || c == HOME_KEY || c == END_KEY;
+  if (!insert && !del && !move)
+  {
+    E.numcursors = 0;
+    return c == '\x1b';
+  }
+  if (!move && !editorCheckWritable())
+    return 1;
+
+  for (int k = 0; k < E.numcursors; k++)
+  {
+    struct editorCursor *cur = &E.cursors[k];
+    if (cur->cy >= E.buf->numrows)
+      continue;
+    erow *row = &E.buf->row[cur->cy];
+    if (!move)
+      editorRowOwn(row);
+    int at = cur->cx, end = cur->cx; // bytes at..end are deleted
+    if (c == BACKSPACE || c == CTRL_KEY('h'))
+      at = editorRowPrevChar(row, cur->cx);
+    else if (c == DEL_KEY)
+      end = editorRowNextChar(row, cur->cx);
+
+    if (insert)
+    {
+      row->chars = realloc(row->chars, row->size + 2);
+      memmove(&row->chars[cur->cx + 1], &row->chars[cur->cx], row->size - cur->cx + 1);
+      row->chars[cur->cx++] = c;
+      row->size++;
+    }
+    else if (del)
+    {
+      memmove(&row->chars[at], &row->chars[end], row->size - end + 1);
+      row->size -= end - at;
+      cur->cx = at;
+    }
+    else if (c == ARROW_LEFT)
+      cur->cx = editorRowPrevChar(row, cur->cx);
+    else if (c == ARROW_RIGHT)
+      cur->cx = editorRowNextChar(row, cur->cx);
+    else
+      cur->cx = c == HOME_KEY ? 0 : row->size;
+  }
+
+  for (int k = 0; k < E.numcursors; k++)
+  {
+    if (E.cursors[k].cy == E.cy)
+      E.cx = E.cursors[k].cx;
+    if (!move && E.cursors[k].cy < E.buf->numrows)
+      editorUpdateRow(&E.buf->row[E.cursors[k].cy]);
+  }
+  if (!move)
+    E.buf->dirty++;
+  return 1;
+}
+
+/*** clipboard ***/
+
+// The region between the mark and the cursor in buffer order, 0 without a mark
+int editorRegion(int *fy, int *fx, int *ty, int *tx)
+{
+  struct editorBuffer *b = E.buf;
+  if (!b->mark || b->numrows == 0)
+    return 0;
+  int my = b->markcy, mx = b->markcx, cy = E.cy, cx = E.cx;
+  if (my >= b->numrows) // rows went away under the mark
+  {
+    my = b->numrows - 1;
+    mx = b->row[my].size;
+  }
+  if (cy >= b->numrows)
+  {
+    cy = b->numrows - 1;
+    cx = b->row[cy].size;
+  }
+  if (mx > b->row[my].size)
+    mx = b->row[my].size;
+  if (my < cy || (my == cy && mx < cx))
+  {
+    *fy = my, *fx = mx, *ty = cy, *tx = cx;
+  }
+  else
+  {
+    *fy = cy, *fx = cx, *ty = my, *tx = mx;
+  }
+  return 1;
+}
+
+// Render indexes [*sa, *sb) of row inside the region, left alone if none
+void editorRegionRx(erow *row, int *sa, int *sb)
+{
+  int fy, fx, ty, tx;
+  if (row->idx >= E.buf->numrows || row != &E.buf->row[row->idx] ||
+      !editorRegion(&fy, &fx, &ty, &tx) || row->idx < fy || row->idx > ty)
+    return;
+  *sa = row->idx == fy ? editorRowCxToRx(row, fx) : 0;
+  *sb = row->idx == ty ? editorRowCxToRx(row, tx) : row->rsize;
+}
+
+void editorClipFree()
+{
+  for (int j = 0; j < E.numclip; j++)
+    editorRelease(E.clip[j].chars, E.clip[j].refs);
+  free(E.clip);
+  E.clip = NULL;
+  E.numclip = 0;
+}
+
+// Copies the region to the clipboard. Whole rows are shared rather than
+// copied, so copying a million lines is a million pointers.
+void editorCopyRegion(int fy, int fx, int ty, int tx)
+{
+  editorClipFree();
+  E.numclip = ty - fy + 1;
+  E.clip = malloc(sizeof(struct clipLine) * E.numclip);
+  for (int y = fy; y <= ty; y++)
+  {
+    erow *row = &E.buf->row[y];
+    struct clipLine *line = &E.clip[y - fy];
+    int from = y == fy ? fx : 0, to = y == ty ? tx : row->size;
+    line->size = to - from;
+    if (from == 0 && to == row->size)
+    {
+      line->chars = row->chars;
+      line->refs = editorShare(&row->refs);
+    }
+    else
+    {
+      line->chars = malloc(line->size + 1);
+      memcpy(line->chars, &row->chars[from], line->size);
+      line->chars[line->size] = '\0';
+      line->refs = NULL;
+    }
+  }
+}
+
+void editorDelRegion(int fy, int fx, int ty, int tx)
+{
+  erow *row = &E.buf->row[fy];
+  if (fy == ty)
+  {
+    editorRowDelChar(row, fx, tx - fx);
+  }
+  else
+  {
+    erow *last = &E.buf->row[ty];
+    editorRowOwn(row);
+    row->size = fx;
+    editorRowAppendString(row, &last->chars[tx], last->size - tx);
+    editorReplaceRows(fy + 1, ty - fy, NULL, NULL, NULL, 0);
+  }
+  E.cy = fy;
+  E.cx = fx;
+}
+
+// Ctrl-W cuts and Ctrl-K copies the region
+void editorCopy(int cut)
+{
+  int fy, fx, ty, tx;
+  if (!editorRegion(&fy, &fx, &ty, &tx))
+  {
+    editorSetStatusMessage("No mark set");
+    return;
+  }
+  if (cut && !editorCheckWritable())
+    return;
+  editorCopyRegion(fy, fx, ty, tx);
+  if (cut)
+    editorDelRegion(fy, fx, ty, tx);
+  E.buf->mark = 0;
+  editorSetStatusMessage("%s %d line%s", cut ? "Cut" : "Copied", E.numclip, E.numclip == 1 ? "" : "s");
+}
+
+// Inserts the clipboard at the cursor. The lines between the first and the
+// last become rows sharing the clipboard's chars until either is edited.
+void editorPaste()
+{
+  if (E.numclip == 0 || !editorCheckWritable())
+    return;
+  if (E.cy == E.buf->numrows)
+    editorInsertRow(E.buf->numrows, "", 0);
+  erow *row = &E.buf->row[E.cy];
+  struct clipLine *first = &E.clip[0], *last = &E.clip[E.numclip - 1];
+  if (E.numclip == 1)
+  {
+    editorRowInsertString(row, E.cx, first->chars, first->size);
+    E.cx += first->size;
+    return;
+  }
+
+  // The row keeps what is before the cursor, the last line takes the rest
+  int taillen = row->size - E.cx;
+  char *tail = malloc(last->size + taillen + 1);
+  memcpy(tail, last->chars, last->size);
+  memcpy(tail + last->size, &row->chars[E.cx], taillen);
+  editorRowOwn(row);
+  row->size = E.cx;
+  editorRowAppendString(row, first->chars, first->size);
+
+  int n = E.numclip - 2;
+  char **lines = malloc(sizeof(char *) * n);
+  size_t *lens = malloc(sizeof(size_t) * n);
+  int **refs = malloc(sizeof(int *) * n);
+  for (int j = 0; j < n; j++)
+  {
+    struct clipLine *line = &E.clip[j + 1];
+    lines[j] = line->chars;
+    lens[j] = line->size;
+    refs[j] = editorShare(&line->refs);
+  }
+  editorReplaceRows(E.cy + 1, 0, lines, lens, refs, n);
+  free(lines);
+  free(lens);
+  free(refs);
+
+  editorInsertRow(E.cy + 1 + n, tail, last->size + taillen);
+  free(tail);
+  E.cy += 1 + n;
+  E.cx = last->size;
+}
+
+/*** child processes ***/
+
+// Runs argv with in, out and err as its stdin, stdout and stderr. An err of
+// -1 sends its errors nowhere, they would garble the screen.
+pid_t editorSpawn(char *const argv[], int in, int out, int err)
+{
+  signal(SIGPIPE, SIG_IGN); // a child that stops reading is its business, not our end
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    signal(SIGPIPE, SIG_DFL);
+    if (err == -1)
+      err = open("/dev/null", O_WRONLY);
+    dup2(in, STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    if (err != -1)
+      dup2(err, STDERR_FILENO);
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  return pid;
+}
+
+// Whether the child ran to the end without complaint
+int editorWaitChild(pid_t pid)
+{
+  int status;
+  while (waitpid(pid, &status, 0) == -1)
+    if (errno != EINTR)
+      return 0;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int editorWriteAll(int fd, const char *buf, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/*** compression ***/
+
+static const struct editorCodec codecs[] = {
+    {".gz", "gzip"}, {".zst", "zstd"}, {".xz", "xz"}, {".bz2", "bzip2"}};
+
+const struct editorCodec *editorCodecFor(const char *filename)
+{
+  const char *ext = filename ? strrchr(filename, '.') : NULL;
+  for (size_t j = 0; ext && j < sizeof(codecs) / sizeof(codecs[0]); j++)
+    if (!strcmp(ext, codecs[j].ext))
+      return &codecs[j];
+  return NULL;
+}
+
+// Runs the codec's program from one fd to another, -dc to decompress and -c to compress
+pid_t editorCodecRun(const struct editorCodec *codec, int decompress, int from, int to)
+{
+  char *argv[] = {(char *)codec->prog, decompress ? "-dc" : "-c", NULL};
+  return editorSpawn(argv, from, to, -1);
+}
+
+// A pipe carrying the decompressed contents of fd, which it takes over.
+// The decompressor is reaped by editorStreamEnd or the caller.
+int editorCodecOpen(const struct editorCodec *codec, int fd, pid_t *pid)
+{
+  int p[2];
+  if (pipe2(p, O_CLOEXEC) == -1)
+  {
+    close(fd);
+    return -1;
+  }
+  *pid = editorCodecRun(codec, 1, fd, p[1]);
+  close(fd);
+  close(p[1]);
+  if (*pid == -1)
+  {
+    close(p[0]);
+    return -1;
+  }
+  return p[0];
+}
+
+// Saves the rows through the compressor a chunk at a time into a temporary
+// file, which replaces the old one only once the compressor is done with it
+int editorSaveCompressed(size_t *len, unsigned long long *hash)
+{
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.sex%d", E.buf->filename, (int)getpid());
+  struct stat st;
+  int mode = stat(E.buf->filename, &st) == 0 ? st.st_mode & 07777 : 0644;
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+  if (fd == -1)
+    return 0;
+  int p[2];
+  pid_t pid = -1;
+  if (pipe2(p, O_CLOEXEC) != -1)
+  {
+    pid = editorCodecRun(E.buf->codec, 0, p[0], fd);
+    close(p[0]);
+  }
+  close(fd);
+  if (pid == -1)
+  {
+    unlink(tmp);
+    return 0;
+  }
+
+  char *chunk = malloc(SEX_STREAM_CHUNK);
+  size_t n = 0;
+  int ok = 1;
+  *len = 0;
+  *hash = HASH_INIT;
+  for (int j = 0; j < E.buf->numrows && ok; j++)
+  {
+    erow *row = &E.buf->row[j];
+    if (n + row->size + 1 > SEX_STREAM_CHUNK)
+    {
+      ok = editorWriteAll(p[1], chunk, n);
+      n = 0;
+    }
+    if (row->size + 1 > SEX_STREAM_CHUNK) // a row bigger than a chunk goes as it is
+    {
+      ok = ok && editorWriteAll(p[1], row->chars, row->size) && editorWriteAll(p[1], "\n", 1);
+      *hash = editorHash("\n", 1, editorHash(row->chars, row->size, *hash));
+    }
+    else
+    {
+      memcpy(chunk + n, row->chars, row->size);
+      chunk[n + row->size] = '\n';
+      *hash = editorHash(chunk + n, row->size + 1, *hash);
+      n += row->size + 1;
+    }
+    *len += row->size + 1;
+  }
+  ok = ok && editorWriteAll(p[1], chunk, n);
+  free(chunk);
+  close(p[1]);
+  ok = editorWaitChild(pid) && ok;
+
+  if (!ok || rename(tmp, E.buf->filename) == -1)
+  {
+    unlink(tmp);
+    errno = ok ? errno : EIO;
+    return 0;
+  }
+  return 1;
+}
+
+/*** filters ***/
+
+// Lines read back from a filter, handed to editorReplaceRows as they are
+struct filterOutput
+{
+  char **lines;
+  size_t *lens;
+  int n, cap;
+  char *part; // line still waiting for its '\n'
+  size_t partlen;
+};
+
+void filterAddLine(struct filterOutput *o, const char *s, size_t len)
+{
+  if (o->n == o->cap)
+  {
+    o->cap = o->cap ? o->cap * 2 : 1024;
+    o->lines = realloc(o->lines, sizeof(char *) * o->cap);
+    o->lens = realloc(o->lens, sizeof(size_t) * o->cap);
+  }
+  char *line = malloc(o->partlen + len + 1);
+  memcpy(line, o->part, o->partlen);
+  memcpy(line + o->partlen, s, len);
+  len += o->partlen;
+  o->partlen = 0;
+  while (len > 0 && line[len - 1] == '\r') // as editorOpen reads lines
+    len--;
+  line[len] = '\0';
+  o->lines[o->n] = line;
+  o->lens[o->n++] = len;
+}
+
+void filterAppend(struct filterOutput *o, const char *s, size_t len)
+{
+  const char *nl;
+  while ((nl = memchr(s, '\n', len)))
+  {
+    filterAddLine(o, s, nl - s);
+    len -= nl + 1 - s;
+    s = nl + 1;
+  }
+  o->part = realloc(o->part, o->partlen + len + 1);
+  memcpy(o->part + o->partlen, s, len);
+  o->partlen += len;
+}
+
+void filterFree(struct filterOutput *o)
+{
+  for (int j = 0; j < o->n; j++)
+    free(o->lines[j]);
+  free(o->lines);
+  free(o->lens);
+  free(o->part);
+}
+
+// C-x | runs the lines of the region, or the whole buffer, through a shell
+// command and puts what it prints in their place as one undoable edit. Rows
+// are fed to it and its output read back a chunk at a time as the pipes
+// allow, while the status bar shows how far it got. Any key stops it and is
+// then handled as usual, as with a macro.
+void editorFilter()
+{
+  if (!editorCheckWritable())
+    return;
+  int from = 0, to = E.buf->numrows, fy, fx, ty, tx;
+  if (editorRegion(&fy, &fx, &ty, &tx))
+  {
+    from = fy;
+    to = tx == 0 && ty > fy ? ty : ty + 1; // a region ending at a line start leaves that line
+  }
+  char *cmd = editorPrompt("Filter through: %s (ESC to cancel)", NULL);
+  if (cmd == NULL)
+    return;
+
+  int in[2] = {-1, -1}, out[2] = {-1, -1}, err[2] = {-1, -1};
+  if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1 || pipe2(err, O_CLOEXEC) == -1)
+  {
+    editorSetStatusMessage("Can't filter: %s", strerror(errno));
+    int *pipes[] = {in, out, err};
+    for (int j = 0; j < 3; j++)
+      if (pipes[j][0] != -1)
+      {
+        close(pipes[j][0]);
+        close(pipes[j][1]);
+      }
+    free(cmd);
+    return;
+  }
+  char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+  pid_t pid = editorSpawn(argv, in[0], out[1], err[1]);
+  close(in[0]);
+  close(out[1]);
+  close(err[1]);
+  struct pollfd pfd[4] = {{STDIN_FILENO, POLLIN, 0}, {in[1], POLLOUT, 0},
+                          {out[0], POLLIN, 0}, {err[0], POLLIN, 0}};
+  for (int j = 1; j < 4; j++)
+  {
+    if (pid == -1) // nothing to talk to
+    {
+      close(pfd[j].fd);
+      pfd[j].fd = -1;
+    }
+    else
+    {
+      fcntl(pfd[j].fd, F_SETFL, fcntl(pfd[j].fd, F_GETFL) | O_NONBLOCK);
+    }
+  }
+
+  size_t chunkcap = SEX_STREAM_CHUNK, chunklen = 0, chunkpos = 0, written = 0, errlen = 0;
+  char *chunk = malloc(chunkcap), errmsg[64] = "";
+  struct filterOutput o = {0};
+  int row = from, cancel = 0;
+  long long shown = clockNs();
+  while (!cancel && (pfd[2].fd != -1 || pfd[3].fd != -1))
+  {
+    if (poll(pfd, 4, 100) == -1 && errno != EINTR)
+      break;
+
+    if (pfd[0].revents & POLLIN) // left unread for editorProcessKeypress
+      cancel = 1;
+
+    if (pfd[1].fd != -1 && pfd[1].revents)
+    {
+      if (chunkpos == chunklen) // refill from the rows
+      {
+        chunkpos = chunklen = 0;
+        if (row < to && (size_t)E.buf->row[row].size + 1 > chunkcap) // a row longer than a chunk
+          chunk = realloc(chunk, chunkcap = E.buf->row[row].size + 1);
+        for (; row < to && chunklen + E.buf->row[row].size + 1 <= chunkcap; row++)
+        {
+          memcpy(chunk + chunklen, E.buf->row[row].chars, E.buf->row[row].size);
+          chunklen += E.buf->row[row].size;
+          chunk[chunklen++] = '\n';
+        }
+      }
+      ssize_t n = chunkpos < chunklen ? write(in[1], chunk + chunkpos, chunklen - chunkpos) : 0;
+      if (n > 0)
+      {
+        chunkpos += n;
+        written += n;
+      }
+      if ((n == -1 && errno != EAGAIN && errno != EINTR) || (chunkpos == chunklen && row == to))
+      {
+        close(in[1]); // all sent, or the command stopped reading
+        pfd[1].fd = -1;
+      }
+    }
+
+    char buf[65536];
+    ssize_t n;
+    if (pfd[2].fd != -1 && pfd[2].revents)
+    {
+      while ((n = read(out[0], buf, sizeof(buf))) > 0)
+        filterAppend(&o, buf, n);
+      if (n == 0 || (errno != EAGAIN && errno != EINTR))
+      {
+        close(out[0]);
+        pfd[2].fd = -1;
+      }
+    }
+    if (pfd[3].fd != -1 && pfd[3].revents) // the start of what it complains about
+    {
+      while ((n = read(err[0], buf, sizeof(buf))) > 0)
+      {
+        size_t keep = errlen + n < sizeof(errmsg) ? (size_t)n : sizeof(errmsg) - 1 - errlen;
+        memcpy(errmsg + errlen, buf, keep);
+        errlen += keep;
+        errmsg[errlen] = '\0';
+      }
+      if (n == 0 || (errno != EAGAIN && errno != EINTR))
+      {
+        close(err[0]);
+        pfd[3].fd = -1;
+      }
+    }
+
+    if (clockNs() - shown > 100000000LL)
+    {
+      editorSetStatusMessage("Filtering: %zuK in, %d lines out, any key stops", written / 1024, o.n);
+      editorRefreshScreen();
+      shown = clockNs();
+    }
+  }
+  for (int j = 1; j < 4; j++)
+    if (pfd[j].fd != -1)
+      close(pfd[j].fd);
+  free(chunk);
+  if (cancel && pid != -1)
+    kill(pid, SIGTERM);
+
+  int ok = pid != -1 && editorWaitChild(pid);
+  errmsg[strcspn(errmsg, "\n")] = '\0';
+  if (cancel)
+    editorSetStatusMessage("Filter cancelled");
+  else if (!ok)
+    editorSetStatusMessage("%.30s failed%s%s", cmd, errlen ? ": " : "", errmsg);
+  else
+  {
+    if (o.partlen > 0) // output without a final newline
+      filterAddLine(&o, "", 0);
+    int **refs = calloc(o.n + 1, sizeof(int *)); // the rows take the lines over
+    editorReplaceRows(from, to - from, o.lines, o.lens, refs, o.n);
+    free(refs);
+    editorSetStatusMessage("Filtered %d lines into %d", to - from, o.n);
+    o.n = 0;
+    E.buf->mark = 0;
+    E.cy = from;
+    E.cx = 0;
+  }
+  filterFree(&o);
+  free(cmd);
+}
+
+/*** file watching ***/
+
+void editorWatchFile()
+{
+  if (E.inotify_fd == -1)
+    E.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (E.inotify_fd == -1 || E.buf->filename == NULL)
+    return;
+  if (E.buf->watch != -1)
+    inotify_rm_watch(E.inotify_fd, E.buf->watch);
+  E.buf->watch = inotify_add_watch(E.inotify_fd, E.buf->filename,
+                                   IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                                       IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+// Drains pending inotify events and flags the buffers whose file may have changed
+void editorWatchEvents()
+{
+  if (E.inotify_fd == -1)
+    return;
+
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  while ((len = read(E.inotify_fd, buf, sizeof(buf))) > 0)
+  {
+    for (char *p = buf; p < buf + len;)
+    {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      for (int j = 0; j < E.numbuffers; j++)
+      {
+        struct editorBuffer *b = E.buffers[j];
+        if (ev->wd != b->watch)
+          continue;
+        b->watch_event = 1;
+        if (ev->mask & (IN_IGNORED | IN_MOVE_SELF | IN_DELETE_SELF))
+          b->watch = -1; // replaced by rename or deleted, watch the new file
+      }
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+
+  // Pick up files that were replaced or created since
+  for (int j = 0; j < E.numbuffers; j++)
+  {
+    struct editorBuffer *b = E.buffers[j];
+    if (b->watch == -1 && b->filename && b->stream_fd == -1 && access(b->filename, F_OK) == 0)
+      b->watch_event = 1;
+  }
+}
+
+void editorRecordDiskState(off_t size, unsigned long long hash)
+{
+  struct stat st;
+  E.buf->disk_size = size;
+  if (E.buf->filename && stat(E.buf->filename, &st) == 0)
+  {
+    E.buf->disk_mtime = st.st_mtim;
+    if (E.buf->codec) // size is what was decompressed, compare against the file
+      E.buf->disk_size = st.st_size;
+  }
+  E.buf->disk_hash = hash;
+  E.buf->disk_changed = 0;
+}
+
+char *editorReadFile(size_t *len)
+{
+  int fd = open(E.buf->filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  pid_t pid = 0;
+  if (E.buf->codec && (fd = editorCodecOpen(E.buf->codec, fd, &pid)) == -1)
+    return NULL;
+
+  size_t cap = st.st_size + 1, n = 0;
+  char *buf = malloc(cap);
+  ssize_t nread;
+  while ((nread = read(fd, buf + n, cap - n)) > 0)
+  {
+    n += nread;
+    if (n == cap)
+      buf = realloc(buf, cap *= 2);
+  }
+  close(fd);
+  if (pid && !editorWaitChild(pid))
+  {
+    free(buf);
+    errno = EIO;
+    return NULL;
+  }
+  *len = n;
+  return buf;
+}
+
+int editorCheckDisk()
+{
+  struct stat st;
+  if (E.buf->filename == NULL || E.buf->disk_changed || stat(E.buf->filename, &st) == -1)
+    return 0;
+  if (st.st_size == E.buf->disk_size &&
+      st.st_mtim.tv_sec == E.buf->disk_mtime.tv_sec &&
+      st.st_mtim.tv_nsec == E.buf->disk_mtime.tv_nsec)
+    return 0;
+
+  size_t len;
+  char *buf = editorReadFile(&len);
+  if (buf == NULL)
+    return 0;
+  unsigned long long hash = editorHash(buf, len, HASH_INIT);
+  free(buf);
+
+  // Touched, not changed. Recompressing can change the size with the same text.
+  if (hash == E.buf->disk_hash && (E.buf->codec || (off_t)len == E.buf->disk_size))
+  {
+    E.buf->disk_mtime = st.st_mtim;
+    E.buf->disk_size = st.st_size;
+    return 0;
+  }
+
+  E.buf->disk_changed = 1;
+  editorSetStatusMessage("%.40s changed on disk. Ctrl-R = reload", E.buf->filename);
+  return 1;
+}
+
+void editorReload()
+{
+  size_t len;
+  char *buf = editorReadFile(&len);
+  if (buf == NULL)
+  {
+    editorSetStatusMessage("Can't reload! I/O error: %s", strerror(errno));
+    return;
+  }
+
+  // Split into lines the same way editorOpen does
+  int nlines = 0, cap = 1024;
+  char **lines = malloc(sizeof(char *) * cap);
+  size_t *lens = malloc(sizeof(size_t) * cap);
+  for (char *p = buf; p < buf + len;)
+  {
+    char *nl = memchr(p, '\n', buf + len - p);
+    size_t linelen = nl ? (size_t)(nl - p) : (size_t)(buf + len - p);
+    if (nlines == cap)
+    {
+      cap *= 2;
+      lines = realloc(lines, sizeof(char *) * cap);
+      lens = realloc(lens, sizeof(size_t) * cap);
+    }
+    lines[nlines] = p;
+    lens[nlines] = linelen;
+    while (lens[nlines] > 0 && p[lens[nlines] - 1] == '\r')
+      lens[nlines]--;
+    nlines++;
+    p += linelen + 1;
+  }
+
+  int oldrows = E.buf->numrows;
+  unsigned long long *oldhash = malloc(sizeof(unsigned long long) * (oldrows + 1));
+  unsigned long long *newhash = malloc(sizeof(unsigned long long) * (nlines + 1));
+  for (int j = 0; j < oldrows; j++)
+    oldhash[j] = editorHash(E.buf->row[j].chars, E.buf->row[j].size, HASH_INIT);
+  for (int j = 0; j < nlines; j++)
+    newhash[j] = editorHash(lines[j], lens[j], HASH_INIT);
+
+  // Greedy line diff: keep rows whose hash matches, resynchronise within a
+  // small window after a mismatch and splice only the differing runs
+  const int window = 64;
+  int oi = 0, ni = 0, at = 0, changed = 0;
+  while (oi < oldrows || ni < nlines)
+  {
+    if (oi < oldrows && ni < nlines && oldhash[oi] == newhash[ni])
+    {
+      oi++, ni++, at++;
+      continue;
+    }
+
+    int del = 1, ins = 1;
+    for (int d = 1; d <= window; d++)
+    {
+      if (oi < oldrows && ni + d < nlines && oldhash[oi] == newhash[ni + d])
+      {
+        del = 0, ins = d;
+        break;
+      }
+      if (ni < nlines && oi + d < oldrows && oldhash[oi + d] == newhash[ni])
+      {
+        del = d, ins = 0;
+        break;
+      }
+      if (oi + d < oldrows && ni + d < nlines && oldhash[oi + d] == newhash[ni + d])
+      {
+        del = d, ins = d;
+        break;
+      }
+    }
+    if (oi + del > oldrows)
+      del = oldrows - oi;
+    if (ni + ins > nlines)
+      ins = nlines - ni;
+    if (oi >= oldrows || ni >= nlines) // one side exhausted, splice the rest
+    {
+      del = oldrows - oi;
+      ins = nlines - ni;
+    }
+
+    editorReplaceRows(at, del, &lines[ni], &lens[ni], NULL, ins);
+    oi += del, ni += ins, at += ins;
+    changed += del > ins ? del : ins;
+  }
+
+  free(oldhash);
+  free(newhash);
+  free(lines);
+  free(lens);
+
+  E.buf->partial = len > 0 && buf[len - 1] != '\n';
+  E.buf->fileoff = len;
+  editorRecordDiskState(len, editorHash(buf, len, HASH_INIT));
+  free(buf);
+  E.buf->dirty = 0;
+
+  if (E.cy > E.buf->numrows)
+    E.cy = E.buf->numrows;
+  if (E.cy < E.buf->numrows && E.cx > E.buf->row[E.cy].size)
+    E.cx = E.buf->row[E.cy].size;
+  else if (E.cy == E.buf->numrows)
+    E.cx = 0;
+  editorSetStatusMessage("Reloaded, %d lines changed", changed);
+}
+
+/*** sessions ***/
+
+// $XDG_STATE_HOME/sex/sessions/<hash of the absolute path of filename>
+char *editorSessionPath(char *buf, size_t size, const char *filename)
+{
+  char real[PATH_MAX], leaf[32];
+  if (realpath(filename, real) == NULL)
+    return NULL;
+  snprintf(leaf, sizeof(leaf), "sessions/%016llx", editorHash(real, strlen(real), HASH_INIT));
+  return editorXdgPath(buf, size, "XDG_STATE_HOME", ".local/state", leaf);
+}
+
+const struct editorSession *editorMapSession(const char *filename)
+{
+  char path[PATH_MAX];
+  if (filename == NULL || editorSessionPath(path, sizeof(path), filename) == NULL)
+    return NULL;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct editorSession))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  struct editorSession *s = map;
+  // Positions are indexes, and sizes are checked against what is left after
+  // each offset, so that a damaged file cannot overflow its way past them
+  if (memcmp(s->magic, SEX_SESSION_MAGIC, sizeof(s->magic)) || s->len != st.st_size ||
+      s->cx < 0 || s->cy < 0 || s->rowoff < 0 || s->coloff < 0 ||
+      s->comments < sizeof(*s) || s->comments > s->len || s->numrows < 0 ||
+      ((unsigned int)s->numrows + 7) / 8 > s->len - s->comments ||
+      s->nmarks < 0 ||
+      (s->nmarks > 0 && (s->marks < sizeof(*s) || s->marks > s->len || // only -R keeps marks
+                         (unsigned long)s->nmarks > (s->len - s->marks) / sizeof(off_t))))
+  {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  return s;
+}
+
+void editorUnmapSession(const struct editorSession *s)
+{
+  munmap((void *)s, s->len);
+}
+
+// Writes s and the count bytes of data after it as the session of filename
+void editorWriteSession(const char *filename, struct editorSession *s, const void *data, int count)
+{
+  char path[PATH_MAX];
+  if (filename == NULL || editorSessionPath(path, sizeof(path), filename) == NULL)
+    return;
+  memcpy(s->magic, SEX_SESSION_MAGIC, sizeof(s->magic));
+  s->len = sizeof(*s) + count;
+  struct abuf img = ABUF_INIT;
+  abAppend(&img, (char *)s, sizeof(*s));
+  if (count > 0)
+    abAppend(&img, data, count);
+  editorWriteCache(path, &img);
+  abFree(&img);
+}
+
+// Maps the session of the file about to load into E.buf. If the file looks
+// unchanged its rows come in with their comment states and are highlighted
+// when shown, editorSessionEnd checks they really are the same.
+void editorSessionOpen()
+{
+  struct editorBuffer *b = E.buf;
+  const struct editorSession *s = editorMapSession(b->filename);
+  struct stat st;
+  if (s == NULL)
+    return;
+  b->session = s;
+  if (s->numrows > 0 && stat(b->filename, &st) == 0 && s->size == st.st_size &&
+      s->mtime.tv_sec == st.st_mtim.tv_sec && s->mtime.tv_nsec == st.st_mtim.tv_nsec)
+    b->comments = (const unsigned char *)s + s->comments;
+}
+
+// Puts the cursor back once E.buf has loaded, unless a line was asked for.
+// Comment states are kept if the text and syntax are what they were for.
+void editorSessionEnd(int ok)
+{
+  struct editorBuffer *b = E.buf;
+  const struct editorSession *s = b->session;
+  if (s == NULL)
+    return;
+  int same = ok && s->hash == b->disk_hash;
+  if (b->comments)
+  {
+    b->comments = NULL;
+    if (!same || b->numundo != 0 || !b->syntax || // edited while it loaded
+        s->syntax != editorHash((const char *)b->syntax, b->syntax->size, HASH_INIT))
+    {
+      for (int j = 0; j < b->numrows; j++) // as editorSelectSyntaxHighlight would have
+        editorHighlightRow(&b->row[j]);
+      b->hlidle = -1;
+    }
+  }
+
+  if (!b->jump && ok && b->numrows > 0)
+  {
+    E.cy = s->cy < b->numrows ? s->cy : b->numrows - 1;
+    E.cx = same && s->cx <= b->row[E.cy].size ? s->cx : 0;
+    E.rowoff = s->rowoff <= E.cy ? s->rowoff : E.cy;
+    E.coloff = same ? s->coloff : 0;
+  }
+  editorUnmapSession(s);
+  b->session = NULL;
+}
+
+// Keeps where E.buf was, and the comment state of each row if they hold
+// what the file does, for the next time the file is opened
+void editorSessionSave()
+{
+  struct editorBuffer *b = E.buf;
+  if (b->filename == NULL || b->stream_fd != -1)
+    return;
+  struct editorSession s;
+  memset(&s, 0, sizeof(s));
+  s.size = b->disk_size;
+  s.mtime = b->disk_mtime;
+  s.hash = b->disk_hash;
+  s.cx = E.cx;
+  s.cy = E.cy;
+  s.rowoff = E.rowoff;
+  s.coloff = E.coloff;
+  s.comments = s.marks = sizeof(s);
+
+  unsigned char *bits = NULL;
+  if (!b->dirty && !b->disk_changed && b->syntax)
+  {
+    s.syntax = editorHash((const char *)b->syntax, b->syntax->size, HASH_INIT);
+    s.numrows = b->numrows;
+    bits = calloc((b->numrows + 7) / 8 + 1, 1);
+    for (int j = 0; j < b->numrows; j++)
+      bits[j >> 3] |= (b->row[j].hl_open_comment != 0) << (j & 7);
+  }
+  editorWriteSession(b->filename, &s, bits, (s.numrows + 7) / 8);
+  free(bits);
+}
+
+// Makes query the newest search, moving it there if it was already kept
+void editorHistoryAdd(const char *query)
+{
+  int j = 0;
+  while (j < E.numhistory && strcmp(E.history[j], query))
+    j++;
+  if (j == E.numhistory && E.numhistory == SEX_HISTORY)
+    j = 0; // the oldest goes
+  if (j < E.numhistory)
+  {
+    free(E.history[j]);
+    memmove(&E.history[j], &E.history[j + 1], sizeof(char *) * (E.numhistory - j - 1));
+    E.numhistory--;
+  }
+  E.history = realloc(E.history, sizeof(char *) * (E.numhistory + 1));
+  E.history[E.numhistory++] = strdup(query);
+}
+
+// Searches are kept a line each in $XDG_STATE_HOME/sex/history
+void editorHistoryLoad()
+{
+  char path[PATH_MAX];
+  FILE *fp;
+  if (editorXdgPath(path, sizeof(path), "XDG_STATE_HOME", ".local/state", "history") == NULL ||
+      (fp = fopen(path, "r")) == NULL)
+    return;
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1)
+  {
+    if (linelen > 0 && line[linelen - 1] == '\n')
+      line[--linelen] = '\0';
+    if (linelen > 0)
+      editorHistoryAdd(line);
+  }
+  free(line);
+  fclose(fp);
+}
+
+void editorHistorySave()
+{
+  char path[PATH_MAX];
+  if (E.numhistory == 0 ||
+      editorXdgPath(path, sizeof(path), "XDG_STATE_HOME", ".local/state", "history") == NULL)
+    return;
+  struct abuf ab = ABUF_INIT;
+  for (int j = 0; j < E.numhistory; j++)
+  {
+    abAppend(&ab, E.history[j], strlen(E.history[j]));
+    abAppend(&ab, "\n", 1);
+  }
+  editorWriteCache(path, &ab);
+  abFree(&ab);
+}
+
+/*** file i/o ***/
+
+char *editorRowsToString(int *buflen)
+{
+  int totlen = 0;
+  int j;
+  for (j = 0; j < E.buf->numrows; j++)
+    totlen += E.buf->row[j].size + 1;
+  *buflen = totlen;
+
+  char *buf = malloc(totlen);
+  char *p = buf;
+  for (j = 0; j < E.buf->numrows; j++)
+  {
+    memcpy(p, E.buf->row[j].chars, E.buf->row[j].size);
+    p += E.buf->row[j].size;
+    *p = '\n';
+    p++;
+  }
+
+  return buf;
+}
+
+void editorOpen(char *filename)
+{
+  TRACE_BEGIN(editorOpen);
+  free(E.buf->filename);
+  E.buf->filename = strdup(filename);
+  E.buf->codec = editorCodecFor(filename);
+  editorSessionOpen();
+
+  editorSelectSyntaxHighlight();
+
+  if (E.buf->codec) // decompressed in the background, editorStreamEnd finishes up
+  {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      die("open");
+    if ((fd = editorCodecOpen(E.buf->codec, fd, &E.buf->stream_pid)) == -1)
+      die("pipe");
+    editorStreamStart(fd, 1);
+    TRACE_END(editorOpen);
+    return;
+  }
+
+  FILE *fp = fopen(filename, "r");
+  if (!fp)
+    die("fopen");
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  unsigned long long hash = HASH_INIT;
+  E.buf->partial = 0;
+  while ((linelen = getline(&line, &linecap, fp)) != -1)
+  {
+    hash = editorHash(line, linelen, hash);
+    E.buf->partial = line[linelen - 1] != '\n';
+    while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                           line[linelen - 1] == '\r'))
+      linelen--;
+    editorInsertRow(E.buf->numrows, line, linelen);
+  }
+  free(line);
+  E.buf->fileoff = ftello(fp);
+  fclose(fp);
+  editorSelectSyntaxHighlight(); // modelines and #! lines need the text
+  editorRecordDiskState(E.buf->fileoff, hash);
+  editorWatchFile();
+  editorUndoFree(E.buf); // loading is not an edit
+  E.buf->dirty = 0;
+  editorSessionEnd(1);
+  TRACE_END(editorOpen);
+}
+
+void editorSave()
+{
+  if (E.buf->filename == NULL)
+  {
+    E.buf->filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.buf->filename == NULL)
+    {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    E.buf->codec = editorCodecFor(E.buf->filename);
+    editorSelectSyntaxHighlight();
+    editorWatchFile();
+  }
+
+  if (editorCheckDisk() || E.buf->disk_changed)
+  {
+    editorSetStatusMessage("File changed on disk since it was read. Overwrite? (y/n)");
+    editorRefreshScreen();
+    if (editorReadKey() != 'y')
+    {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+  }
+
+  TRACE_BEGIN(editorSave);
+  if (E.buf->codec)
+  {
+    size_t len;
+    unsigned long long hash;
+    if (editorSaveCompressed(&len, &hash))
+    {
+      editorWatchFile(); // the watch was on the file just replaced
+      editorRecordDiskState(len, hash);
+      E.buf->dirty = 0;
+      editorSetStatusMessage("%zu bytes written to disk through %s", len, E.buf->codec->prog);
+    }
+    else
+      editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    TRACE_END(editorSave);
+    return;
+  }
+
+  int len;
+  char *buf = editorRowsToString(&len);
+
+  int fd = open(E.buf->filename, O_RDWR | O_CREAT, 0644);
+  if (fd != -1)
+  {
+    if (ftruncate(fd, len) != -1)
+    {
+      if (write(fd, buf, len) == len)
+      {
+        close(fd);
+        editorRecordDiskState(len, editorHash(buf, len, HASH_INIT));
+        free(buf);
+        E.buf->dirty = 0;
+        editorSetStatusMessage("%d bytes written to disk", len);
+        TRACE_END(editorSave);
+        return;
+      }
+    }
+    close(fd);
+  }
+
+  free(buf);
+  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  TRACE_END(editorSave);
+}
+
+/*** follow mode ***/
+
+void editorAppendText(const char *s, size_t len)
+{
+  while (len > 0)
+  {
+    const char *nl = memchr(s, '\n', len);
+    size_t seglen = nl ? (size_t)(nl - s) : len;
+
+    if (E.buf->partial && E.buf->numrows > 0)
+    {
+      erow *row = &E.buf->row[E.buf->numrows - 1];
+      editorRowAppendString(row, (char *)s, seglen);
+      if (nl && row->size > 0 && row->chars[row->size - 1] == '\r')
+        editorRowDelChar(row, row->size - 1, 1);
+    }
+    else
+    {
+      size_t rowlen = seglen;
+      if (nl && rowlen > 0 && s[rowlen - 1] == '\r')
+        rowlen--;
+      editorInsertRow(E.buf->numrows, (char *)s, rowlen);
+    }
+
+    E.buf->partial = (nl == NULL);
+    if (!nl)
+      break;
+    s = nl + 1;
+    len -= seglen + 1;
+  }
+}
+
+int editorFollowRead()
+{
+  struct stat st;
+  if (fstat(E.buf->follow_fd, &st) == -1)
+    return 0;
+
+  if (st.st_size < E.buf->fileoff) // truncated or rotated in place, start over
+  {
+    for (int j = 0; j < E.buf->numrows; j++)
+      editorFreeRow(&E.buf->row[j]);
+    E.buf->numrows = 0;
+    editorWrapFree(E.buf);
+    E.cy = E.cx = E.rowoff = 0;
+    E.buf->fileoff = 0;
+    E.buf->partial = 0;
+  }
+  if (st.st_size == E.buf->fileoff)
+    return 0;
+
+  int pinned = E.cy >= E.buf->numrows - 1;
+  char buf[65536];
+  ssize_t nread;
+  while ((nread = pread(E.buf->follow_fd, buf, sizeof(buf), E.buf->fileoff)) > 0)
+  {
+    editorAppendText(buf, nread);
+    E.buf->fileoff += nread;
+  }
+
+  E.buf->dirty = 0;
+  if (pinned && E.buf->numrows > 0)
+  {
+    E.cy = E.buf->numrows - 1;
+    E.cx = 0;
+  }
+  return 1;
+}
+
+void editorFollowStart()
+{
+  if (E.buf->codec)
+  {
+    editorSetStatusMessage("Can't follow a compressed file");
+    return;
+  }
+  E.buf->follow_fd = open(E.buf->filename, O_RDONLY);
+  if (E.buf->follow_fd == -1)
+    die("open");
+
+  E.buf->follow = 1;
+  E.buf->readonly = 1;
+  if (E.buf->numrows > 0)
+    E.cy = E.buf->numrows - 1;
+  editorFollowRead(); // catch anything written since editorOpen
+}
+
+/*** streaming ***/
+
+void editorStreamStart(int fd, int file)
+{
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  E.buf->stream_fd = fd;
+  E.buf->stream_file = file;
+  E.buf->stream_bytes = 0;
+  E.buf->stream_hash = HASH_INIT;
+  E.buf->partial = 0;
+  if (E.streams++ == 0)
+    editorSetReadTimeout(0); // the poll in editorIdle does the waiting
+}
+
+void editorStreamEnd(const char *err)
+{
+  close(E.buf->stream_fd);
+  E.buf->stream_fd = -1;
+  if (E.buf->stream_pid) // closing the pipe ends the decompressor if it is still going
+  {
+    if (!editorWaitChild(E.buf->stream_pid) && !err)
+      err = "decompression failed";
+    E.buf->stream_pid = 0;
+  }
+  if (--E.streams == 0)
+    editorSetReadTimeout(1);
+
+  if (err)
+    editorSetStatusMessage("Read error after %zu bytes: %s", E.buf->stream_bytes, err);
+  else if (!E.buf->stream_file)
+    editorSetStatusMessage("%zu bytes read from stdin", E.buf->stream_bytes);
+
+  if (E.buf->stream_file && !err) // same bookkeeping as editorOpen
+  {
+    E.buf->fileoff = E.buf->stream_bytes;
+    editorRecordDiskState(E.buf->stream_bytes, E.buf->stream_hash);
+    editorWatchFile();
+  }
+  editorSelectSyntaxHighlight();
+  editorSessionEnd(E.buf->stream_file && !err);
+  if (E.buf->jump)
+    editorJumpToLine(E.buf->jump);
+  E.buf->jump = 0;
+}
+
+// Appends whole chunks from the buffer's stream until deadline
+int editorStreamRead(long long deadline)
+{
+  static char *buf = NULL;
+  if (!buf)
+    buf = malloc(SEX_STREAM_CHUNK);
+
+  int dirty = E.buf->dirty;
+  do
+  {
+    ssize_t nread = read(E.buf->stream_fd, buf, SEX_STREAM_CHUNK);
+    if (nread > 0)
+    {
+      editorAppendText(buf, nread);
+      E.buf->stream_bytes += nread;
+      if (E.buf->stream_file)
+        E.buf->stream_hash = editorHash(buf, nread, E.buf->stream_hash);
+    }
+    else if (nread == 0)
+    {
+      editorStreamEnd(NULL);
+      break;
+    }
+    else
+    {
+      if (errno != EAGAIN && errno != EINTR)
+        editorStreamEnd(strerror(errno));
+      break;
+    }
+  } while (clockNs() < deadline);
+  E.buf->dirty = dirty;
+  return 1;
+}
+
+/*** buffers ***/
+
+struct editorBuffer *editorNewBuffer()
+{
+  struct editorBuffer *b = calloc(1, sizeof(struct editorBuffer));
+  b->follow_fd = -1;
+  b->watch = -1;
+  b->stream_fd = -1;
+  b->hlidle = -1;
+  E.buffers = realloc(E.buffers, sizeof(struct editorBuffer *) * (E.numbuffers + 1));
+  E.buffers[E.numbuffers++] = b;
+  return b;
+}
+
+// Makes b the buffer that every editor operation works on. Also used to
+// briefly service buffers that are not shown, so it only swaps the view.
+void editorSetBuffer(struct editorBuffer *b)
+{
+  if (b == E.buf)
+    return;
+  if (E.buf)
+  {
+    E.buf->cx = E.cx;
+    E.buf->cy = E.cy;
+    E.buf->rowoff = E.rowoff;
+    E.buf->coloff = E.coloff;
+  }
+  E.buf = b;
+  E.cx = b->cx;
+  E.cy = b->cy;
+  E.rowoff = b->rowoff;
+  E.coloff = b->coloff;
+  E.wrapoff = 0;
+}
+
+int editorBufferIndex(struct editorBuffer *b)
+{
+  for (int j = 0; j < E.numbuffers; j++)
+    if (E.buffers[j] == b)
+      return j;
+  return -1;
+}
+
+void editorSwitchBuffer(int idx)
+{
+  editorSetBuffer(E.buffers[(idx + E.numbuffers) % E.numbuffers]);
+  editorSetStatusMessage("[%d/%d] %s", editorBufferIndex(E.buf) + 1, E.numbuffers,
+                         E.buf->filename ? E.buf->filename : "[No Name]");
+}
+
+// Starts reading filename into a new buffer from the idle loop
+void editorLoadBuffer(char *filename)
+{
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1 && errno != ENOENT)
+  {
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    return;
+  }
+
+  struct editorBuffer *shown = E.buf;
+  editorSetBuffer(editorNewBuffer());
+  E.buf->filename = strdup(filename);
+  E.buf->codec = editorCodecFor(filename);
+  if (fd != -1)
+    editorSessionOpen();
+  editorSelectSyntaxHighlight();
+  if (fd != -1 && E.buf->codec)
+    fd = editorCodecOpen(E.buf->codec, fd, &E.buf->stream_pid);
+  if (fd != -1)
+    editorStreamStart(fd, 1);
+  editorSetBuffer(shown);
+}
+
+void editorOpenBuffer()
+{
+  char *filename = editorPrompt("Open: %s (ESC to cancel)", NULL);
+  if (filename == NULL)
+    return;
+
+  for (int j = 0; j < E.numbuffers; j++)
+  {
+    if (E.buffers[j]->filename && !strcmp(E.buffers[j]->filename, filename))
+    {
+      free(filename);
+      editorSwitchBuffer(j);
+      return;
+    }
+  }
+
+  int count = E.numbuffers;
+  editorLoadBuffer(filename);
+  free(filename);
+  if (E.numbuffers > count)
+    editorSwitchBuffer(E.numbuffers - 1);
+}
+
+void editorBufferSwitcher()
+{
+  char *query = editorPrompt("Buffer (name or number): %s", NULL);
+  if (query == NULL)
+    return;
+
+  char *end;
+  long n = strtol(query, &end, 10);
+  int found = -1;
+  if (*end == '\0' && n >= 1 && n <= E.numbuffers)
+    found = n - 1;
+  for (int j = 0; j < E.numbuffers && found == -1; j++)
+    if (E.buffers[j]->filename && strstr(E.buffers[j]->filename, query))
+      found = j;
+
+  if (found == -1)
+    editorSetStatusMessage("No buffer matches %s", query);
+  else
+    editorSwitchBuffer(found);
+  free(query);
+}
+
+void editorCloseBuffer()
+{
+  if (E.buf->dirty)
+  {
+    editorSetStatusMessage("Buffer has unsaved changes. Close anyway? (y/n)");
+    editorRefreshScreen();
+    if (editorReadKey() != 'y')
+    {
+      editorSetStatusMessage("");
+      return;
+    }
+  }
+
+  editorSessionSave();
+  struct editorBuffer *b = E.buf;
+  int idx = editorBufferIndex(b);
+  if (b->stream_fd != -1) // nothing of editorStreamEnd's bookkeeping is wanted for it now
+  {
+    close(b->stream_fd);
+    if (b->stream_pid)
+      editorWaitChild(b->stream_pid);
+    if (--E.streams == 0)
+      editorSetReadTimeout(1);
+  }
+  if (b->session)
+    editorUnmapSession(b->session);
+  for (int j = 0; j < b->numrows; j++)
+    editorFreeRow(&b->row[j]);
+  free(b->row);
+  free(b->filename);
+  free(b->words.nodes);
+  free(b->words.edges);
+  editorWrapFree(b);
+  free(b->brtree);
+  editorUndoFree(b);
+  if (b->follow_fd != -1)
+    close(b->follow_fd);
+  if (b->watch != -1)
+    inotify_rm_watch(E.inotify_fd, b->watch);
+
+  memmove(&E.buffers[idx], &E.buffers[idx + 1],
+          sizeof(struct editorBuffer *) * (E.numbuffers - idx - 1));
+  E.numbuffers--;
+  E.buf = NULL;
+  free(b);
+  if (E.numbuffers == 0)
+    editorNewBuffer();
+  editorSwitchBuffer(idx > 0 ? idx - 1 : 0);
+
+  for (int j = 0; j < E.numviews; j++) // other views of it show the same buffer now
+  {
+    struct editorView *v = &E.views[j];
+    if (v->buf == b)
+    {
+      v->buf = E.buf;
+      v->cx = E.cx;
+      v->cy = E.cy;
+      v->rowoff = E.rowoff;
+      v->coloff = E.coloff;
+    }
+  }
+}
+
+// Saves the session of every buffer and the searches, before quitting
+void editorSessionQuit()
+{
+  for (int j = 0; j < E.numbuffers; j++)
+  {
+    editorSetBuffer(E.buffers[j]);
+    editorSessionSave();
+  }
+  editorHistorySave();
+}
+
+/*** views ***/
+
+// Columns the line numbers of a buffer take in a view cols wide, with a
+// space after them. At least three digits, so short files don't shift.
+int editorGutterWidth(struct editorBuffer *buf, int cols)
+{
+  if (E.linenumbers == GUTTER_OFF)
+    return 0;
+  int digits = 3;
+  for (int n = buf->numrows; n >= 1000; n /= 10)
+    digits++;
+  return digits + 1 < cols ? digits + 1 : 0;
+}
+
+void editorSaveView()
+{
+  struct editorView *v = &E.views[E.view];
+  v->buf = E.buf;
+  v->cx = E.cx;
+  v->cy = E.cy;
+  v->rx = E.rx;
+  v->rowoff = E.rowoff;
+  v->coloff = E.coloff;
+  v->wrap = E.wrap;
+  v->wrapoff = E.wrapoff;
+}
+
+void editorLoadView(int idx)
+{
+  E.view = (idx + E.numviews) % E.numviews;
+  struct editorView *v = &E.views[E.view];
+  editorSetBuffer(v->buf);
+  E.cx = v->cx;
+  E.cy = v->cy;
+  E.rx = v->rx;
+  E.rowoff = v->rowoff;
+  E.coloff = v->coloff;
+  E.wrap = v->wrap;
+  E.wrapoff = v->wrapoff;
+  E.screenrows = v->rows;
+  E.screencols = v->cols - editorGutterWidth(v->buf, v->cols);
+}
+
+void editorSelectView(int idx)
+{
+  editorSaveView();
+  editorLoadView(idx);
+}
+
+// Splits the current view in two showing the same buffer, side by side
+// with a separator column when vertical, stacked otherwise
+void editorSplitView(int vertical)
+{
+  editorSaveView();
+  struct editorView v = E.views[E.view];
+  struct editorView n = v;
+  n.gutter_cells = NULL;
+  n.gutter_lines = 0;
+  if (vertical)
+  {
+    n.cols = (v.cols - 1) / 2;
+    v.cols -= n.cols + 1;
+    n.left = v.left + v.cols + 1;
+  }
+  else
+  {
+    n.rows = (v.rows - 1) / 2;
+    v.rows -= n.rows + 1;
+    n.top = v.top + v.rows + 1;
+  }
+  if (v.rows < 1 || v.cols < 1 || n.rows < 1 || n.cols < 1)
+  {
+    editorSetStatusMessage("Window too small to split");
+    return;
+  }
+
+  E.views = realloc(E.views, sizeof(struct editorView) * (E.numviews + 1));
+  memmove(&E.views[E.view + 2], &E.views[E.view + 1],
+          sizeof(struct editorView) * (E.numviews - E.view - 1));
+  E.views[E.view] = v;
+  E.views[E.view + 1] = n;
+  E.numviews++;
+  E.repaint = 1;
+  editorLoadView(E.view);
+}
+
+// Whether n lies along one side of v: 0 left, 1 right, 2 above, 3 below
+int editorViewBorders(struct editorView *n, struct editorView *v, int side)
+{
+  if (side < 2)
+    return (side == 0 ? n->left + n->cols + 1 == v->left : n->left == v->left + v->cols + 1) &&
+           n->top >= v->top && n->top + n->rows <= v->top + v->rows;
+  return (side == 2 ? n->top + n->rows + 1 == v->top : n->top == v->top + v->rows + 1) &&
+         n->left >= v->left && n->left + n->cols <= v->left + v->cols;
+}
+
+// Gives the space of the current view to the views along one of its sides.
+// Splits only ever halve a view, so some side is always covered exactly.
+void editorCloseView()
+{
+  if (E.numviews == 1)
+  {
+    editorSetStatusMessage("Can't close the only window");
+    return;
+  }
+  struct editorView *v = &E.views[E.view];
+
+  for (int side = 0; side < 4; side++)
+  {
+    int covered = 0, first = -1;
+    for (int j = 0; j < E.numviews; j++)
+    {
+      if (j == E.view || !editorViewBorders(&E.views[j], v, side))
+        continue;
+      covered += side < 2 ? E.views[j].rows + 1 : E.views[j].cols + 1;
+      if (first == -1)
+        first = j;
+    }
+    if (covered != (side < 2 ? v->rows + 1 : v->cols + 1))
+      continue;
+
+    for (int j = 0; j < E.numviews; j++)
+    {
+      struct editorView *n = &E.views[j];
+      if (j == E.view || !editorViewBorders(n, v, side))
+        continue;
+      if (side < 2)
+      {
+        n->left = side == 0 ? n->left : v->left;
+        n->cols += v->cols + 1;
+      }
+      else
+      {
+        n->top = side == 2 ? n->top : v->top;
+        n->rows += v->rows + 1;
+      }
+    }
+
+    free(v->gutter_cells);
+    memmove(v, v + 1, sizeof(struct editorView) * (E.numviews - E.view - 1));
+    E.numviews--;
+    E.repaint = 1;
+    editorLoadView(first > E.view ? first - 1 : first);
+    return;
+  }
+  editorSetStatusMessage("Can't close this window");
+}
+
+void editorOnlyView()
+{
+  editorSaveView();
+  for (int j = 0; j < E.numviews; j++)
+    if (j != E.view)
+      free(E.views[j].gutter_cells);
+  E.views[0] = E.views[E.view];
+  E.views[0].top = 0;
+  E.views[0].left = 0;
+  E.views[0].rows = E.termrows - 2; // status bar and message bar
+  E.views[0].cols = E.termcols;
+  E.numviews = 1;
+  E.repaint = 1;
+  editorLoadView(0);
+}
+
+// Scales the layout to a new terminal size. Positions along each axis are
+// scaled the same way, so views that shared an edge still do.
+void editorResize()
+{
+  E.resized = 0;
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0 || ws.ws_row < 3)
+    return; // keep the old size rather than query the terminal again
+
+  editorSaveView();
+  int oldh = E.termrows - 1, oldw = E.termcols + 1; // a view's span includes its status bar and separator
+  int newh = ws.ws_row - 1, neww = ws.ws_col + 1;
+  int fits = 1;
+  for (int j = 0; j < E.numviews; j++)
+  {
+    struct editorView *v = &E.views[j];
+    int top = v->top * newh / oldh, bottom = (v->top + v->rows + 1) * newh / oldh;
+    int left = v->left * neww / oldw, right = (v->left + v->cols + 1) * neww / oldw;
+    v->top = top;
+    v->rows = bottom - top - 1;
+    v->left = left;
+    v->cols = right - left - 1;
+    fits &= v->rows >= 1 && v->cols >= 1;
+  }
+  E.termrows = ws.ws_row;
+  E.termcols = ws.ws_col;
+
+  for (int j = 0; j < E.numbuffers; j++) // the old widths are unlikely to come back
+    editorWrapFree(E.buffers[j]);
+  E.repaint = 1;
+  if (fits)
+    editorLoadView(E.view);
+  else
+    editorOnlyView();
+}
+
+/*** find ***/
+
+void editorFindCallback(char *query, int key)
+{
+  static int last_match = -1;
+  static int direction = 1;
+
+  static int saved_hl_line;
+  static char *saved_hl = NULL;
+
+  if (saved_hl)
+  {
+    memcpy(E.buf->row[saved_hl_line].hl, saved_hl, E.buf->row[saved_hl_line].rsize);
+    E.buf->version++;
+    free(saved_hl);
+    saved_hl = NULL;
+  }
+
+  if (key == '\r' || key == '\x1b')
+  {
+    last_match = -1;
+    direction = 1;
+    return;
+  }
+  else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+  {
+    direction = 1;
+  }
+  else if (key == ARROW_LEFT || key == ARROW_UP)
+  {
+    direction = -1;
+  }
+  else
+  {
+    last_match = -1;
+    direction = 1;
+  }
+
+  TRACE_BEGIN(editorFindCallback);
+  if (last_match == -1)
+    direction = 1;
+  int current = last_match;
+  int i;
+  for (i = 0; i < E.buf->numrows; i++)
+  {
+    current += direction;
+    if (current == -1)
+      current = E.buf->numrows - 1;
+    else if (current == E.buf->numrows)
+      current = 0;
+
+    erow *row = &E.buf->row[current];
+    char *match = strstr(row->render, query);
+    if (match)
+    {
+      if (row->hlstale) // the match is drawn over its highlight
+        editorUpdateSyntax(row);
+      last_match = current;
+      E.cy = current;
+      E.cx = editorRowRxToCx(row, match - row->render);
+      E.rowoff = E.buf->numrows;
+
+      saved_hl_line = current;
+      saved_hl = malloc(row->rsize);
+      memcpy(saved_hl, row->hl, row->rsize);
+      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+      E.buf->version++;
+      break;
+    }
+  }
+  TRACE_END(editorFindCallback);
+}
+
+void editorFind()
+{
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+
+  char *query = editorPromptHistory("Search: %s (Use ESC/Arrows/Enter, C-p/C-n history)",
+                                    editorFindCallback, 1);
+
+  if (query)
+  {
+    free(query);
+  }
+  else
+  {
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+
+// Accepts a line number or a percentage of the file, e.g. 120 or 50%
+void editorGotoLine()
+{
+  char *query = editorPrompt("Go to line: %s (N or N%%, ESC to cancel)", NULL);
+  if (query == NULL)
+    return;
+
+  char *end;
+  long n = strtol(query, &end, 10);
+  if (end == query || (*end && strcmp(end, "%")))
+    editorSetStatusMessage("Not a line number: %s", query);
+  else if (*end == '%')
+    editorJumpToLine(n >= 100 ? E.buf->numrows : (long)((long long)E.buf->numrows * n / 100) + 1);
+  else
+    editorJumpToLine(n);
+  free(query);
+}
+
+/*** output ***/
+
+// Screen line of the cursor counting from the top of the file, when wrapping
+int editorWrapCursorLine(struct wrapIndex *w)
+{
+  int line = editorWrapPrefix(w, E.cy);
+  if (E.cy < E.buf->numrows)
+    line += editorRowWrapLine(&E.buf->row[E.cy], E.rx, E.screencols);
+  return line;
+}
+
+void editorScroll()
+{
+  // The gutter widens with the line count, the text area gets what is left
+  struct editorView *v = &E.views[E.view];
+  E.screencols = v->cols - editorGutterWidth(E.buf, v->cols);
+
+  E.rx = 0;
+  if (E.cy < E.buf->numrows)
+  {
+    E.rx = editorRowCxToRx(&E.buf->row[E.cy], E.cx);
+  }
+
+  if (E.wrap) // scroll by screen lines, found through the wrap index
+  {
+    struct wrapIndex *w = editorWrapBuild(E.buf, E.screencols);
+    E.coloff = 0;
+    if (E.rowoff > E.buf->numrows)
+      E.rowoff = E.buf->numrows;
+    if (E.rowoff < E.buf->numrows && E.wrapoff >= editorRowWrap(&E.buf->row[E.rowoff], E.screencols))
+      E.wrapoff = 0;
+    int line = editorWrapCursorLine(w);
+    int top = editorWrapPrefix(w, E.rowoff) + E.wrapoff;
+    if (line < top)
+      top = line;
+    if (line >= top + E.screenrows)
+      top = line - E.screenrows + 1;
+    E.rowoff = editorWrapFind(w, top, &E.wrapoff);
+    return;
+  }
+
+  if (E.cy < E.rowoff)
+  {
+    E.rowoff = E.cy;
+  }
+  if (E.cy >= E.rowoff + E.screenrows)
+  {
+    E.rowoff = E.cy - E.screenrows + 1;
+  }
+  int col = E.cy < E.buf->numrows ? editorRowRxToCol(&E.buf->row[E.cy], E.rx) : E.rx;
+  if (col < E.coloff)
+  {
+    E.coloff = col;
+  }
+  if (col >= E.coloff + E.screencols)
+  {
+    E.coloff = col - E.screencols + 1;
+  }
+}
+
+// Hash of everything the text area of v depends on, unchanged means no redraw
+unsigned long long editorViewSignature(struct editorView *v)
+{
+  int state[] = {v->rowoff, v->coloff, v->wrap, v->wrapoff, v->top, v->left, v->rows, v->cols, v->gutter,
+                 (int)v->buf->version};
+  unsigned long long h = editorHash((const char *)&v->buf, sizeof(v->buf), HASH_INIT);
+  if (v->buf == E.buf)
+  {
+    h = editorHash((const char *)E.match_row, sizeof(E.match_row), h);
+    h = editorHash((const char *)E.match_rx, sizeof(E.match_rx), h);
+    h = editorHash((const char *)E.cursors, sizeof(struct editorCursor) * E.numcursors, h);
+    if (E.buf->mark)
+    {
+      int region[] = {E.buf->markcx, E.buf->markcy, E.cx, E.cy};
+      h = editorHash((const char *)region, sizeof(region), h);
+    }
+  }
+  return editorHash((const char *)state, sizeof(state), h);
+}
+
+// Line numbers for the rows a view shows. Each screen line keeps the number
+// it shows with its formatted cell, so only cells whose number changed are
+// formatted and written, e.g. just the cursor line when relative numbers scroll.
+void editorDrawGutter(struct abuf *ab, struct editorView *v)
+{
+  struct editorBuffer *buf = v->buf;
+  int w = editorGutterWidth(buf, v->cols);
+  if (v->gutter_lines != v->rows || v->gutter != w)
+  {
+    v->gutter_cells = realloc(v->gutter_cells, sizeof(struct gutterCell) * v->rows);
+    v->gutter_lines = v->rows;
+    for (int y = 0; y < v->rows; y++)
+      v->gutter_cells[y].num = -1;
+  }
+  v->gutter = w;
+  if (w == 0)
+    return;
+
+  int cols = v->cols - w;
+  int filerow = v->rowoff, sub = v->wrapoff;
+  if (!v->wrap || filerow >= buf->numrows || sub >= editorRowWrap(&buf->row[filerow], cols))
+    sub = 0;
+  for (int y = 0; y < v->rows; y++)
+  {
+    int num = 0; // past the end and on wrapped continuation lines
+    if (filerow < buf->numrows)
+    {
+      if (sub == 0)
+        num = E.linenumbers == GUTTER_RELATIVE && filerow != v->cy ? abs(filerow - v->cy) : filerow + 1;
+      if (!v->wrap || ++sub >= editorRowWrap(&buf->row[filerow], cols))
+      {
+        filerow++;
+        sub = 0;
+      }
+    }
+
+    struct gutterCell *cell = &v->gutter_cells[y];
+    if (cell->num != num)
+    {
+      memset(cell->text, ' ', w);
+      for (int j = w - 2, n = num; n > 0; j--, n /= 10)
+        cell->text[j] = '0' + n % 10;
+      cell->num = num;
+      cell->drawn = 0;
+    }
+    if (cell->drawn && !E.repaint)
+      continue;
+    char pos[32];
+    int plen = snprintf(pos, sizeof(pos), "\x1b[%d;%dH", v->top + y + 1, v->left + 1);
+    abAppend(ab, pos, plen);
+    abAppend(ab, cell->text, w);
+    cell->drawn = 1;
+  }
+}
+
+// Clears the rest of a view's line, leaving any view to its right alone
+void editorDrawEol(struct abuf *ab, struct editorView *v, int width)
+{
+  if (v->left + v->cols == E.termcols)
+  {
+    abAppend(ab, "\x1b[K", 3);
+    return;
+  }
+  for (; width < v->cols; width++)
+    abAppend(ab, " ", 1);
+  abAppend(ab, "|", 1); // separator column
+}
+
+// Draws render[j..end) of row until cols screen columns are used, returns the columns used
+int editorDrawRender(struct abuf *ab, erow *row, int j, int end, int width, int cols)
+{
+  char *c = row->render;
+  unsigned char *hl = row->hl;
+  int current_color = -1;
+  int crx = editorCursorRx(row), sa = 0, sb = 0, reverse = 0;
+  editorRegionRx(row, &sa, &sb);
+  while (j < end)
+  {
+    int n = 1, w = 1, cp = (unsigned char)c[j], h = hl[j];
+    if ((row == E.match_row[0] && j == E.match_rx[0]) || (row == E.match_row[1] && j == E.match_rx[1]))
+      h = HL_MATCH;
+    if (row->cw)
+    {
+      n = utf8Decode(&c[j], row->rsize - j, &cp);
+      w = row->cw[j];
+    }
+    if (width + w > cols)
+      break;
+    width += w;
+    int inv = j == crx || (j >= sa && j < sb); // extra cursors and the region
+    if (inv != reverse)
+    {
+      abAppend(ab, inv ? "\x1b[7m" : "\x1b[27m", inv ? 4 : 5);
+      reverse = inv;
+    }
+
+    if (cp == -1 || (cp < 0x80 && iscntrl(cp)) || (cp >= 0x80 && cp < 0xA0))
+    {
+      char sym = (cp >= 0 && cp <= 26) ? '@' + cp : '?';
+      abAppend(ab, "\x1b[7m", 4);
+      abAppend(ab, &sym, 1);
+      abAppend(ab, "\x1b[m", 3);
+      reverse = 0;
+      if (current_color != -1)
+      {
+        char buf[16];
+        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+        abAppend(ab, buf, clen);
+      }
+    }
+    else if (h == HL_NORMAL)
+    {
+      if (current_color != -1)
+      {
+        abAppend(ab, "\x1b[39m", 5);
+        current_color = -1;
+      }
+      abAppend(ab, &c[j], n);
+    }
+    else
+    {
+      int color = editorSyntaxToColor(h);
+      if (color != current_color)
+      {
+        current_color = color;
+        char buf[16];
+        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+        abAppend(ab, buf, clen);
+      }
+      abAppend(ab, &c[j], n);
+    }
+    j += n;
+  }
+  if (reverse)
+    abAppend(ab, "\x1b[27m", 5);
+  if (crx == row->rsize && j == crx && width < cols)
+  {
+    abAppend(ab, "\x1b[7m \x1b[27m", 10);
+    width++;
+  }
+  abAppend(ab, "\x1b[39m", 5);
+  return width;
+}
+
+void editorDrawRows(struct abuf *ab, struct editorView *v)
+{
+  struct editorBuffer *buf = v->buf;
+  int cols = v->cols - v->gutter;
+  int filerow = v->rowoff, sub = v->wrapoff; // sub is the screen line within filerow when wrapping
+  if (!v->wrap || filerow >= buf->numrows || sub >= editorRowWrap(&buf->row[filerow], cols))
+    sub = 0;
+  int y;
+  for (y = 0; y < v->rows; y++)
+  {
+    char pos[32];
+    int plen = snprintf(pos, sizeof(pos), "\x1b[%d;%dH", v->top + y + 1, v->left + v->gutter + 1);
+    abAppend(ab, pos, plen);
+    int width = 0;
+
+    if (filerow >= buf->numrows)
+    {
+      if (buf->numrows == 0 && y == v->rows / 3)
+      {
+        char welcome[80];
+        int welcomelen = snprintf(welcome, sizeof(welcome),
+                                  "Simplified Editor Extended -- version %s", SEX_VERSION);
+        if (welcomelen > cols)
+          welcomelen = cols;
+        int padding = (cols - welcomelen) / 2;
+        width = padding + welcomelen;
+        if (padding)
+        {
+          abAppend(ab, "~", 1);
+          padding--;
+        }
+        while (padding--)
+          abAppend(ab, " ", 1);
+        abAppend(ab, welcome, welcomelen);
+      }
+      else
+      {
+        abAppend(ab, "~", 1);
+        width = 1;
+      }
+      filerow++;
+    }
+    else if (v->wrap)
+    {
+      erow *row = &buf->row[filerow];
+      int n = editorRowWrap(row, cols);
+      int end = sub + 1 < n ? editorRowWrapStart(row, sub + 1, cols) : row->rsize;
+      width = editorDrawRender(ab, row, editorRowWrapStart(row, sub, cols), end, 0, cols);
+      if (++sub >= n)
+      {
+        filerow++;
+        sub = 0;
+      }
+    }
+    else
+    {
+      erow *row = &buf->row[filerow];
+      int j = v->coloff, col = v->coloff;
+      if (row->cw) // find the first character at or right of coloff
+      {
+        j = col = 0;
+        while (j < row->rsize && (col < v->coloff || row->cw[j] == 0))
+          col += row->cw[j++];
+      }
+      for (; width < col - v->coloff && width < cols; width++)
+        abAppend(ab, " ", 1); // wide character cut by the left edge
+
+      width = editorDrawRender(ab, row, j, row->rsize, width, cols);
+      filerow++;
+    }
+
+    editorDrawEol(ab, v, v->gutter + width);
+  }
+}
+
+void editorDrawStatusBar(struct abuf *ab, struct editorView *v)
+{
+  struct editorBuffer *buf = v->buf;
+  char status[80], rstatus[80];
+  char reading[32] = "";
+  if (buf->stream_fd != -1)
+    snprintf(reading, sizeof(reading), "(reading %zuK)", buf->stream_bytes / 1024);
+  char bufidx[32] = "";
+  if (E.numbuffers > 1)
+    snprintf(bufidx, sizeof(bufidx), "[%d/%d] ", editorBufferIndex(buf) + 1, E.numbuffers);
+  int len = snprintf(status, sizeof(status), "%s%.20s - %d lines %s%s",
+                     bufidx, buf->filename ? buf->filename : "[No Name]", buf->numrows,
+                     buf->stream_fd != -1 ? reading : buf->follow ? "(follow)"
+                                                 : buf->dirty    ? "(modified)"
+                                                              : "",
+                     buf->disk_changed ? "(changed on disk)" : "");
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+                      buf->syntax ? SYNSTR(buf->syntax, buf->syntax->filetype) : "no ft",
+                      v->cy + 1, buf->numrows);
+
+  unsigned long long sig = editorHash(rstatus, rlen, editorHash(status, len, HASH_INIT));
+  if (sig == v->drawn_status && !E.repaint)
+    return;
+  v->drawn_status = sig;
+
+  char pos[32];
+  int plen = snprintf(pos, sizeof(pos), "\x1b[%d;%dH", v->top + v->rows + 1, v->left + 1);
+  abAppend(ab, pos, plen);
+  abAppend(ab, "\x1b[7m", 4);
+  if (len > v->cols)
+    len = v->cols;
+  abAppend(ab, status, len);
+  while (len < v->cols)
+  {
+    if (v->cols - len == rlen)
+    {
+      abAppend(ab, rstatus, rlen);
+      break;
+    }
+    else
+    {
+      abAppend(ab, " ", 1);
+      len++;
+    }
+  }
+  abAppend(ab, "\x1b[m", 3);
+  if (v->left + v->cols < E.termcols)
+    abAppend(ab, "|", 1);
+}
+
+#ifdef SEX_PROFILE
+int profCompare(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+void editorProfileEndFrame(int written)
+{
+  memcpy(P.last, P.phase, sizeof(P.phase));
+  memset(P.phase, 0, sizeof(P.phase));
+  P.frames[P.nframes++ % SEX_PROF_FRAMES] =
+      P.last[PH_INPUT] + P.last[PH_DRAW] + P.last[PH_WRITE];
+  P.last_hlbytes = P.hlbytes;
+  P.hlbytes = 0;
+  P.written = written;
+}
+
+void editorDrawProfile(struct abuf *ab)
+{
+  int n = P.nframes < SEX_PROF_FRAMES ? P.nframes : SEX_PROF_FRAMES;
+  long long sorted[SEX_PROF_FRAMES];
+  memcpy(sorted, P.frames, n * sizeof(long long));
+  qsort(sorted, n, sizeof(long long), profCompare);
+  long long p99 = n ? sorted[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1] : 0;
+
+  size_t heap = 0;
+  for (int j = 0; j < E.buf->numrows; j++)
+    heap += E.buf->row[j].size + 1 + (E.buf->row[j].rsize + 1) + E.buf->row[j].rsize;
+
+  char hud[160];
+  int len = snprintf(hud, sizeof(hud),
+                     "in %.2f syn %.2f draw %.2f wr %.2f p99 %.2f ms | "
+                     "%dB out | %d rows | %zuK heap | %lldB hl",
+                     P.last[PH_INPUT] / 1e6, P.last[PH_SYNTAX] / 1e6,
+                     P.last[PH_DRAW] / 1e6, P.last[PH_WRITE] / 1e6, p99 / 1e6,
+                     P.written, E.buf->numrows, heap / 1024, P.last_hlbytes);
+  if (len > E.termcols)
+    len = E.termcols;
+  abAppend(ab, hud, len);
+}
+#endif
+
+void editorDrawMessageBar(struct abuf *ab)
+{
+  char pos[32];
+  int plen = snprintf(pos, sizeof(pos), "\x1b[%d;1H\x1b[K", E.termrows);
+  abAppend(ab, pos, plen);
+#ifdef SEX_PROFILE
+  if (P.show)
+  {
+    editorDrawProfile(ab);
+    return;
+  }
+#endif
+  int msglen = strlen(E.statusmsg);
+  if (msglen > E.termcols)
+    msglen = E.termcols;
+  if (msglen && time(NULL) - E.statusmsg_time < 5)
+    abAppend(ab, E.statusmsg, msglen);
+}
+
+void editorRefreshScreen()
+{
+  if (E.replaying)
+    return;
+  if (E.pager)
+  {
+    editorPagerRefresh();
+    return;
+  }
+  TRACE_BEGIN(editorRefreshScreen);
+  PROF_BEGIN(PH_DRAW);
+  editorScroll();
+  editorSaveView();
+  for (int j = 0; j < E.numviews; j++) // before brackets are matched in them
+    editorHighlightShown(&E.views[j]);
+
+  E.match_row[0] = E.match_row[1] = NULL;
+  int mrow, mrx;
+  if (editorMatchBracket(E.cy, E.rx, &mrow, &mrx))
+  {
+    E.match_row[0] = &E.buf->row[E.cy];
+    E.match_rx[0] = E.rx;
+    E.match_row[1] = &E.buf->row[mrow];
+    E.match_rx[1] = mrx;
+  }
+
+  struct abuf ab = ABUF_INIT;
+
+  abAppend(&ab, "\x1b[?25l", 6);
+
+  // Only views whose position or buffer changed since the last frame are drawn
+  for (int j = 0; j < E.numviews; j++)
+  {
+    struct editorView *v = &E.views[j];
+    if (v->cy > v->buf->numrows) // rows were deleted through another view
+      v->cy = v->buf->numrows;
+    if (v->rowoff > v->cy)
+      v->rowoff = v->cy;
+
+    editorDrawGutter(&ab, v);
+    unsigned long long sig = editorViewSignature(v);
+    if (sig != v->drawn || E.repaint)
+      editorDrawRows(&ab, v);
+    v->drawn = sig;
+    editorDrawStatusBar(&ab, v);
+  }
+  editorDrawMessageBar(&ab);
+  E.repaint = 0;
+
+  struct editorView *v = &E.views[E.view];
+  int y = E.cy - E.rowoff;
+  int col = E.cy < E.buf->numrows ? editorRowRxToCol(&E.buf->row[E.cy], E.rx) : E.rx;
+  if (E.wrap)
+  {
+    struct wrapIndex *w = editorWrapBuild(E.buf, E.screencols); // for this view's width
+    y = editorWrapCursorLine(w) - editorWrapPrefix(w, E.rowoff) - E.wrapoff;
+    if (E.cy < E.buf->numrows)
+    {
+      erow *row = &E.buf->row[E.cy];
+      int start = editorRowWrapStart(row, editorRowWrapLine(row, E.rx, E.screencols), E.screencols);
+      col -= editorRowRxToCol(row, start);
+    }
+    if (col >= E.screencols)
+      col = E.screencols - 1;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", v->top + y + 1,
+           v->left + v->gutter + (col - E.coloff) + 1);
+  abAppend(&ab, buf, strlen(buf));
+
+  abAppend(&ab, "\x1b[?25h", 6);
+  PROF_END(PH_DRAW);
+
+  PROF_BEGIN(PH_WRITE);
+  write(STDOUT_FILENO, ab.b, ab.len);
+  PROF_END(PH_WRITE);
+#ifdef SEX_PROFILE
+  editorProfileEndFrame(ab.len);
+#endif
+  abFree(&ab);
+  TRACE_END(editorRefreshScreen);
+}
+
+void editorSetStatusMessage(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+  va_end(ap);
+  E.statusmsg_time = time(NULL);
+}
+
+/*** input ***/
+
+int editorIdle()
+{
+  static long long last_redraw = 0;
+  int redraw = 0;
+
+  // While something is being streamed in, wait on it and the keyboard at once
+  struct pollfd *pfd = NULL;
+  if (E.streams > 0)
+  {
+    pfd = malloc(sizeof(struct pollfd) * (E.numbuffers + 1));
+    pfd[0].fd = STDIN_FILENO;
+    pfd[0].events = POLLIN;
+    for (int j = 0; j < E.numbuffers; j++)
+    {
+      pfd[j + 1].fd = E.buffers[j]->stream_fd; // -1 is ignored by poll
+      pfd[j + 1].events = POLLIN;
+      pfd[j + 1].revents = 0;
+    }
+    if (poll(pfd, E.numbuffers + 1, 100) <= 0 || (pfd[0].revents & POLLIN))
+    {
+      free(pfd);
+      pfd = NULL;
+    }
+  }
+
+  editorWatchEvents();
+  int journal = E.journal; // what arrives on its own can't be undone
+  E.journal = 0;
+  struct editorBuffer *shown = E.buf;
+  int wrapoff = E.wrapoff; // editorSetBuffer resets it, it is still the same view after
+  long long deadline = clockNs() + 16000000LL; // then give the keyboard a turn
+  for (int j = 0; j < E.numbuffers; j++)
+  {
+    struct editorBuffer *b = E.buffers[j];
+    // Without inotify the file is checked with an fstat per tick instead
+    int check = b->watch_event || (E.inotify_fd == -1 && b->filename && b->stream_fd == -1);
+    int stream = pfd && b->stream_fd != -1 && pfd[j + 1].revents;
+    int lazy = b->hlidle != -1 && !b->comments; // not while it may turn out wrong
+    if (!check && !stream && !lazy)
+      continue;
+
+    editorSetBuffer(b);
+    int changed = 0;
+    if (check)
+    {
+      b->watch_event = 0;
+      if (b->watch == -1 && b->filename && access(b->filename, F_OK) == 0)
+        editorWatchFile();
+      changed |= b->follow ? editorFollowRead() : editorCheckDisk();
+    }
+    if (stream && clockNs() < deadline)
+      changed |= editorStreamRead(deadline);
+    if (lazy && clockNs() < deadline) // off screen, nothing to redraw
+      editorHighlightIdle(deadline);
+    for (int k = 0; k < E.numviews; k++) // only redraw for buffers on screen
+      redraw |= changed && (b == shown || E.views[k].buf == b);
+  }
+  editorSetBuffer(shown);
+  E.wrapoff = wrapoff;
+  E.journal = journal;
+  free(pfd);
+
+  if (!redraw || (E.streams > 0 && clockNs() - last_redraw < 50000000LL))
+    return 0;
+  last_redraw = clockNs();
+  return 1;
+}
+
+int editorCheckWritable()
+{
+  if (E.buf->readonly)
+  {
+    editorSetStatusMessage("Buffer is read-only");
+    return 0;
+  }
+  return 1;
+}
+
+// With history, C-p and C-n step through earlier searches and the answer
+// becomes the newest
+char *editorPromptHistory(char *prompt, void (*callback)(char *, int), int history)
+{
+  size_t bufsize = 128;
+  char *buf = malloc(bufsize);
+
+  size_t buflen = 0;
+  buf[0] = '\0';
+  int pos = E.numhistory; // history entry shown, numhistory for what was typed
+
+  while (1)
+  {
+    editorSetStatusMessage(prompt, buf);
+    editorRefreshScreen();
+
+    int c = editorReadKey();
+    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
+    {
+      if (buflen != 0)
+        buf[--buflen] = '\0';
+    }
+    else if (c == '\x1b')
+    {
+      editorSetStatusMessage("");
+      if (callback)
+        callback(buf, c);
+      free(buf);
+      return NULL;
+    }
+    else if (c == '\r')
+    {
+      if (buflen != 0)
+      {
+        editorSetStatusMessage("");
+        if (callback)
+          callback(buf, c);
+        if (history)
+          editorHistoryAdd(buf);
+        return buf;
+      }
+    }
+    else if (history && (c == CTRL_KEY('p') || c == CTRL_KEY('n')))
+    {
+      pos += c == CTRL_KEY('p') ? -(pos > 0) : pos < E.numhistory;
+      const char *s = pos < E.numhistory ? E.history[pos] : "";
+      buflen = strlen(s);
+      if (buflen >= bufsize)
+      {
+        bufsize = buflen + 1;
+        buf = realloc(buf, bufsize);
+      }
+      memcpy(buf, s, buflen + 1);
+    }
+    else if (!iscntrl(c) && c < 128)
+    {
+      if (buflen == bufsize - 1)
+      {
+        bufsize *= 2;
+        buf = realloc(buf, bufsize);
+      }
+      buf[buflen++] = c;
+      buf[buflen] = '\0';
+    }
+
+    if (callback)
+      callback(buf, c);
+  }
+}
+
+char *editorPrompt(char *prompt, void (*callback)(char *, int))
+{
+  return editorPromptHistory(prompt, callback, 0);
+}
+
+void editorMoveCursor(int key)
+{
+  erow *row = (E.cy >= E.buf->numrows) ? NULL : &E.buf->row[E.cy];
+
+  switch (key)
+  {
+  case ARROW_LEFT:
+    if (E.cx != 0)
+    {
+      E.cx = editorRowPrevChar(row, E.cx);
+    }
+    else if (E.cy > 0)
+    {
+      E.cy--;
+      E.cx = E.buf->row[E.cy].size;
+    }
+    break;
+  case ARROW_RIGHT:
+    if (row && E.cx < row->size)
+    {
+      E.cx = editorRowNextChar(row, E.cx);
+    }
+    else if (row && E.cx == row->size)
+    {
+      E.cy++;
+      E.cx = 0;
+    }
+    break;
+  case ARROW_UP:
+    if (E.cy != 0)
+    {
+      E.cy--;
+    }
+    break;
+  case ARROW_DOWN:
+    if (E.cy < E.buf->numrows)
+    {
+      E.cy++;
+    }
+    break;
+  }
+
+  row = (E.cy >= E.buf->numrows) ? NULL : &E.buf->row[E.cy];
+  int rowlen = row ? row->size : 0;
+  if (E.cx > rowlen)
+  {
+    E.cx = rowlen;
+  }
+  while (row && E.cx > 0 && E.cx < rowlen && is_continuation(row->chars[E.cx]))
+    E.cx--; // moved up or down into the middle of a character
+}
+
+/*** macros ***/
+
+// Whether a key is waiting, which stops a running macro and is then
+// handled as usual, so Esc cancels without doing anything else
+int editorKeyPending()
+{
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  return poll(&pfd, 1, 0) > 0;
+}
+
+// Replays the macro count times. Keys go through editorProcessKeypress as
+// if typed, but the screen is only refreshed now and then to show progress
+// and highlighting is done once at the end for every row touched.
+void editorRunMacro(int count)
+{
+  if (E.replaying)
+    return; // a macro that runs itself
+  if (E.macrolen == 0)
+  {
+    editorSetStatusMessage("No macro defined");
+    return;
+  }
+
+  E.replaying = 1;
+  long long shown = clockNs();
+  int run;
+  for (run = 0; run < count && !editorKeyPending(); run++)
+  {
+    E.replaypos = 0;
+    while (E.replaypos < E.macrolen)
+      editorProcessKeypress();
+    if (clockNs() - shown > 250000000LL)
+    {
+      editorSetStatusMessage("Running macro %d/%d, any key stops", run + 1, count);
+      E.replaying = 0;
+      editorRefreshScreen();
+      E.replaying = 1;
+      shown = clockNs();
+    }
+  }
+  E.replaypos = -1;
+  E.replaying = 0;
+
+  struct editorBuffer *cur = E.buf;
+  for (int j = 0; j < E.numbuffers; j++)
+  {
+    editorSetBuffer(E.buffers[j]);
+    editorFlushSyntax();
+  }
+  editorSetBuffer(cur);
+  if (run < count)
+    editorSetStatusMessage("Macro stopped after %d of %d runs", run, count);
+  else
+    editorSetStatusMessage("Ran macro %d time%s", run, run == 1 ? "" : "s");
+}
+
+void editorMacroCount()
+{
+  char *count = editorPrompt("Run macro how many times: %s (Enter for once)", NULL);
+  if (count == NULL)
+    return;
+  int n = *count ? atoi(count) : 1;
+  free(count);
+  if (n > 0)
+    editorRunMacro(n);
+}
+
+// Second key of a Ctrl-X sequence
+void editorProcessPrefix()
+{
+  editorSetStatusMessage("C-x-");
+  editorRefreshScreen();
+  int c = editorReadKey();
+  editorSetStatusMessage("");
+
+  switch (c)
+  {
+  case 'b':
+    editorBufferSwitcher();
+    break;
+
+  case 'k':
+    editorCloseBuffer();
+    break;
+
+  case '2':
+  case '3':
+    editorSplitView(c == '3');
+    break;
+
+  case 'o':
+    editorSelectView(E.view + 1);
+    break;
+
+  case '0':
+    editorCloseView();
+    break;
+
+  case '1':
+    editorOnlyView();
+    break;
+
+  case 'w':
+    E.wrap = !E.wrap;
+    E.wrapoff = 0;
+    E.coloff = 0;
+    editorSetStatusMessage("Soft wrap %s", E.wrap ? "on" : "off");
+    break;
+
+  case 'c':
+    editorColumnCursors();
+    break;
+
+  case '|':
+    editorFilter();
+    break;
+
+  case '(':
+    E.recording = 1;
+    E.macrolen = 0;
+    editorSetStatusMessage("Defining macro, C-x ) to end");
+    break;
+
+  case ')':
+  case 'e':
+    if (E.recording)
+    {
+      E.recording = 0;
+      E.macrolen = E.macrolen >= 2 ? E.macrolen - 2 : 0; // not the C-x ) itself
+      editorSetStatusMessage("Macro of %d keys defined", E.macrolen);
+    }
+    if (c == 'e')
+      editorMacroCount();
+    break;
+
+  case 'n':
+  {
+    static const char *modes[] = {"off", "absolute", "relative"};
+    E.linenumbers = (E.linenumbers + 1) % 3;
+    editorSetStatusMessage("Line numbers %s", modes[E.linenumbers]);
+    break;
+  }
+  }
+}
+
+void editorProcessKeypress()
+{
+  static int quit_times = SEX_QUIT_TIMES;
+
+  int c = editorReadKey();
+  PROF_BEGIN(PH_INPUT);
+  editorUndoBegin(c);
+
+  if (E.numcursors && editorCursorsKey(c))
+  {
+    PROF_END(PH_INPUT);
+    return;
+  }
+
+  switch (c)
+  {
+  case '\r':
+    if (editorCheckWritable())
+      editorInsertNewline();
+    break;
+
+  case CTRL_KEY('q'):
+  {
+    int dirty = 0;
+    for (int j = 0; j < E.numbuffers; j++)
+      dirty |= E.buffers[j]->dirty;
+    if (dirty && quit_times > 0)
+    {
+      editorSetStatusMessage("WARNING!!! File has unsaved changes. "
+                             "Press Ctrl-Q %d more times to quit.",
+                             quit_times);
+      quit_times--;
+      return;
+    }
+    editorSessionQuit();
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    exit(0);
+  }
+  break;
+
+  case CTRL_KEY('s'):
+    if (editorCheckWritable())
+      editorSave();
+    break;
+
+  case HOME_KEY:
+    E.cx = 0;
+    break;
+
+  case END_KEY:
+    if (E.cy < E.buf->numrows)
+      E.cx = E.buf->row[E.cy].size;
+    break;
+
+  case CTRL_KEY('f'):
+    editorFind();
+    break;
+
+  case CTRL_KEY('g'):
+    editorGotoLine();
+    break;
+
+  case CTRL_KEY('n'):
+    if (editorCheckWritable())
+      editorComplete();
+    break;
+
+  case CTRL_KEY('b'):
+    editorSwitchBuffer(editorBufferIndex(E.buf) + 1);
+    break;
+
+  case CTRL_KEY('o'):
+    editorOpenBuffer();
+    break;
+
+  case CTRL_KEY('x'):
+    editorProcessPrefix();
+    break;
+
+  case CTRL_KEY('r'):
+    if (E.buf->filename == NULL || !editorCheckWritable())
+      break;
+    if (E.buf->dirty)
+    {
+      editorSetStatusMessage("Discard unsaved changes and reload? (y/n)");
+      editorRefreshScreen();
+      if (editorReadKey() != 'y')
+      {
+        editorSetStatusMessage("");
+        break;
+      }
+    }
+    editorReload();
+    break;
+
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+  case DEL_KEY:
+    if (!editorCheckWritable())
+      break;
+    if (c == DEL_KEY)
+      editorMoveCursor(ARROW_RIGHT);
+    else
+      editorDelPair();
+    editorDelChar();
+    break;
+
+  case PAGE_UP:
+  case PAGE_DOWN:
+  {
+    // A screen past the top or bottom line of the view
+    if (c == PAGE_UP)
+    {
+      E.cy = E.rowoff - E.screenrows;
+      if (E.cy < 0)
+        E.cy = 0;
+    }
+    else if (c == PAGE_DOWN)
+    {
+      E.cy = E.rowoff + 2 * E.screenrows - 1;
+      if (E.cy > E.buf->numrows)
+        E.cy = E.buf->numrows;
+    }
+
+    int rowlen = E.cy < E.buf->numrows ? E.buf->row[E.cy].size : 0;
+    if (E.cx > rowlen)
+      E.cx = rowlen;
+  }
+  break;
+
+  case ARROW_UP:
+  case ARROW_DOWN:
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+    editorMoveCursor(c);
+    break;
+
+#ifdef SEX_PROFILE
+  case CTRL_KEY('p'):
+    P.show = !P.show;
+    break;
+#endif
+
+  case CTRL_KEY('l'):
+    E.repaint = 1;
+    break;
+
+  case CTRL_KEY('@'): // Ctrl-Space
+    editorSetMark();
+    break;
+
+  case CTRL_KEY('w'):
+  case CTRL_KEY('k'):
+    editorCopy(c == CTRL_KEY('w'));
+    break;
+
+  case CTRL_KEY('y'):
+    editorPaste();
+    break;
+
+  case CTRL_KEY('z'):
+    editorUndo();
+    break;
+
+  case '\x1b':
+    break;
+
+  default:
+    if (editorCheckWritable())
+      editorTypeChar(c);
+    break;
+  }
+
+  quit_times = SEX_QUIT_TIMES;
+  PROF_END(PH_INPUT);
+}
+
+/*** large file viewer ***/
+
+int editorPagerRows()
+{
+  return E.termrows > 2 ? E.termrows - 2 : 1;
+}
+
+// The mapped bytes from off to the end of the window. The window moves to
+// start at off when off is outside it or fewer than want bytes are left.
+const char *editorPagerBytes(off_t off, size_t want, size_t *len)
+{
+  struct editorPager *p = E.pager;
+  *len = 0;
+  if (off >= p->size)
+    return NULL;
+  if ((off_t)want > p->size - off)
+    want = p->size - off;
+  if (p->map == NULL || off < p->mapoff || off + (off_t)want > p->mapoff + (off_t)p->maplen)
+  {
+    if (p->map)
+      munmap(p->map, p->maplen);
+    p->mapoff = off - off % sysconf(_SC_PAGESIZE);
+    p->maplen = p->size - p->mapoff < SEX_PAGER_WINDOW ? p->size - p->mapoff : SEX_PAGER_WINDOW;
+    p->map = mmap(NULL, p->maplen, PROT_READ, MAP_SHARED, p->fd, p->mapoff);
+    if (p->map == MAP_FAILED)
+      die("mmap");
+    madvise(p->map, p->maplen, MADV_SEQUENTIAL); // read ahead, and drop pages behind
+  }
+  *len = p->mapoff + p->maplen - off;
+  return p->map + (off - p->mapoff);
+}
+
+// Offset just past count newlines from off, fewer if the file ends first
+off_t editorPagerSkip(off_t off, long count, long *skipped)
+{
+  const char *s;
+  size_t len;
+  *skipped = 0;
+  for (off_t pos = off; *skipped < count && (s = editorPagerBytes(pos, 1, &len)); pos += len)
+  {
+    for (const char *nl = s; *skipped < count && (nl = memchr(nl, '\n', s + len - nl)); nl++)
+    {
+      (*skipped)++;
+      off = pos + (nl + 1 - s);
+    }
+  }
+  return off;
+}
+
+// Offset of the line after the one at off, the file size after the last line
+off_t editorPagerNext(off_t off)
+{
+  long skipped;
+  off = editorPagerSkip(off, 1, &skipped);
+  return skipped ? off : E.pager->size;
+}
+
+// Screen column of the byte at in the line starting at off
+int editorPagerColumn(off_t off, off_t at)
+{
+  int col = 0;
+  size_t len;
+  const char *s = editorPagerBytes(off, at - off, &len);
+  for (off_t j = 0; s && j < at - off && j < (off_t)len;)
+  {
+    int cp = (unsigned char)s[j], n = 1;
+    if (cp >= 0x80)
+      n = utf8Decode(&s[j], len - j < 4 ? (int)(len - j) : 4, &cp);
+    col = cp == '\t' ? col + SEX_TAB_STOP - col % SEX_TAB_STOP : col + (cp >= 0x80 ? charWidth(cp) : 1);
+    j += n;
+  }
+  return col;
+}
+
+// Adds the next checkpoint to the index, 0 once it reached the end of the file
+int editorPagerIndexStep()
+{
+  struct editorPager *p = E.pager;
+  if (p->lines != -1)
+    return 0;
+  long n;
+  off_t off = editorPagerSkip(p->marks[p->nmarks - 1], SEX_PAGER_STEP, &n);
+  if (n == SEX_PAGER_STEP && off < p->size)
+  {
+    if ((p->nmarks & (p->nmarks - 1)) == 0) // grown by doubling
+      p->marks = realloc(p->marks, sizeof(off_t) * p->nmarks * 2);
+    p->marks[p->nmarks++] = off;
+    return 1;
+  }
+  p->lines = (p->nmarks - 1) * (long)SEX_PAGER_STEP + n + (off < p->size); // last line may lack '\n'
+  return 0;
+}
+
+// Indexes the rest of the file to know how many lines it has. Any key stops it.
+int editorPagerIndexAll()
+{
+  while (editorPagerIndexStep())
+  {
+    if (E.pager->nmarks % 256 == 0 && editorKeyPending())
+    {
+      editorSetStatusMessage("Counting lines interrupted at %ld",
+                             (E.pager->nmarks - 1) * (long)SEX_PAGER_STEP);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Offset of line n, or -1 if the file has fewer lines
+off_t editorPagerLine(long n)
+{
+  struct editorPager *p = E.pager;
+  long k = n / SEX_PAGER_STEP;
+  while (k >= p->nmarks && editorPagerIndexStep())
+    ;
+  if (k >= p->nmarks)
+    return -1;
+
+  long from = k * SEX_PAGER_STEP, skipped;
+  off_t off = p->marks[k];
+  if (p->top > from && p->top <= n) // lines near the screen are found from its top
+  {
+    from = p->top;
+    off = p->topoff;
+  }
+  off = editorPagerSkip(off, n - from, &skipped);
+  return skipped == n - from && off < p->size ? off : -1;
+}
+
+// Moves the top of the screen by delta lines, stopping at the last screen
+void editorPagerScroll(long delta)
+{
+  struct editorPager *p = E.pager;
+  long n = p->top + delta < 0 ? 0 : p->top + delta;
+  off_t off = editorPagerLine(n);
+  if (off == -1 && p->lines != -1)
+  {
+    n = p->lines - editorPagerRows();
+    if (n <= p->top)
+      return;
+    off = editorPagerLine(n);
+  }
+  if (off != -1)
+  {
+    p->top = n;
+    p->topoff = off;
+  }
+}
+
+// Hash of the first and last SEX_SESSION_SAMPLE bytes. Hashing all of a file
+// this big would take as long as indexing it again.
+unsigned long long editorPagerHash()
+{
+  size_t len;
+  off_t tail = E.pager->size > SEX_SESSION_SAMPLE ? E.pager->size - SEX_SESSION_SAMPLE : 0;
+  const char *s = editorPagerBytes(0, SEX_SESSION_SAMPLE, &len);
+  unsigned long long h = editorHash(s, len < SEX_SESSION_SAMPLE ? len : SEX_SESSION_SAMPLE, HASH_INIT);
+  s = editorPagerBytes(tail, SEX_SESSION_SAMPLE, &len);
+  return editorHash(s, len < SEX_SESSION_SAMPLE ? len : SEX_SESSION_SAMPLE, h);
+}
+
+// Whether the index in s can be the one of the file it is for: it starts at
+// the start and every checkpoint comes after the last, inside the file
+int editorPagerSessionMarks(const struct editorSession *s)
+{
+  const char *marks = (const char *)s + s->marks;
+  off_t prev = -1, off;
+  for (long j = 0; j < s->nmarks; j++)
+  {
+    memcpy(&off, marks + sizeof(off_t) * j, sizeof(off_t));
+    if ((j == 0 && off != 0) || off <= prev || off >= s->size)
+      return 0;
+    prev = off;
+  }
+  return s->top >= 0 && s->topoff >= 0 && s->topoff <= s->size;
+}
+
+// Takes back the index and position of the last session if st is the file it was for
+void editorPagerSessionOpen(struct stat *st)
+{
+  struct editorPager *p = E.pager;
+  const struct editorSession *s = editorMapSession(p->filename);
+  if (s == NULL)
+    return;
+  if (s->nmarks > 0 && s->size == st->st_size && s->mtime.tv_sec == st->st_mtim.tv_sec &&
+      s->mtime.tv_nsec == st->st_mtim.tv_nsec && s->hash == editorPagerHash() &&
+      editorPagerSessionMarks(s))
+  {
+    long cap = 1;
+    while (cap < s->nmarks) // as editorPagerIndexStep grows it
+      cap *= 2;
+    p->marks = realloc(p->marks, sizeof(off_t) * cap);
+    memcpy(p->marks, (const char *)s + s->marks, sizeof(off_t) * s->nmarks);
+    p->nmarks = s->nmarks;
+    p->lines = s->lines;
+    p->top = s->top;
+    p->topoff = s->topoff;
+    p->coloff = s->coloff;
+  }
+  editorUnmapSession(s);
+}
+
+void editorPagerSessionSave()
+{
+  struct editorPager *p = E.pager;
+  struct editorSession s;
+  struct stat st;
+  if (fstat(p->fd, &st) == -1 || st.st_size != p->size) // the index is of what was mapped
+    return;
+  memset(&s, 0, sizeof(s));
+  s.size = st.st_size;
+  s.mtime = st.st_mtim;
+  s.hash = editorPagerHash();
+  s.top = p->top;
+  s.topoff = p->topoff;
+  s.coloff = p->coloff;
+  s.nmarks = p->nmarks;
+  s.lines = p->lines;
+  s.comments = s.marks = sizeof(s);
+  editorWriteSession(p->filename, &s, p->marks, sizeof(off_t) * p->nmarks);
+}
+
+void editorPagerOpen(char *filename)
+{
+  struct editorPager *p = calloc(1, sizeof(struct editorPager));
+  struct stat st;
+  p->fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (p->fd == -1 || fstat(p->fd, &st) == -1)
+    die(filename);
+  if (!S_ISREG(st.st_mode))
+  {
+    errno = EINVAL; // only files can be mapped
+    die(filename);
+  }
+  p->filename = strdup(filename);
+  p->size = st.st_size;
+  p->marks = malloc(sizeof(off_t));
+  p->marks[0] = 0;
+  p->nmarks = 1;
+  p->lines = -1;
+  E.pager = p;
+  editorPagerSessionOpen(&st);
+}
+
+// Draws one line from the file, with tabs expanded and matches of the last search
+void editorPagerDrawLine(struct abuf *ab, off_t off)
+{
+  struct editorPager *p = E.pager;
+  int cols = E.termcols;
+  size_t len;
+  const char *s = editorPagerBytes(off, (size_t)(p->coloff + cols) * 4, &len); // enough for what fits
+  const char *nl = memchr(s, '\n', len);
+  if (nl)
+    len = nl - s;
+  if (len > 0 && s[len - 1] == '\r')
+    len--;
+
+  size_t qlen = p->query ? strlen(p->query) : 0;
+  const char *match = qlen ? memmem(s, len, p->query, qlen) : NULL;
+  int col = 0, color = 0;
+  for (size_t j = 0; j < len && col < p->coloff + cols;)
+  {
+    int cp = (unsigned char)s[j], n = 1, w = 1;
+    if (cp >= 0x80)
+    {
+      n = utf8Decode(&s[j], len - j < 4 ? (int)(len - j) : 4, &cp);
+      w = cp == -1 ? 1 : charWidth(cp);
+    }
+    if (match && s + j >= match + qlen)
+      match = memmem(s + j, len - j, p->query, qlen);
+    int hl = match && s + j >= match;
+    if (hl != color)
+    {
+      char buf[16];
+      int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", hl ? editorSyntaxToColor(HL_MATCH) : 39);
+      abAppend(ab, buf, clen);
+      color = hl;
+    }
+
+    if (cp == '\t')
+    {
+      do
+      {
+        if (col >= p->coloff && col < p->coloff + cols)
+          abAppend(ab, " ", 1);
+        col++;
+      } while (col % SEX_TAB_STOP != 0);
+    }
+    else if (col < p->coloff || col + w > p->coloff + cols)
+    {
+      if (col + w > p->coloff && col < p->coloff + cols) // half of a wide character
+        abAppend(ab, " ", 1);
+      col += w;
+    }
+    else if (cp == -1 || (cp < 0x80 && iscntrl(cp)) || (cp >= 0x80 && cp < 0xA0))
+    {
+      char sym = (cp >= 0 && cp <= 26) ? '@' + cp : '?';
+      abAppend(ab, "\x1b[7m", 4);
+      abAppend(ab, &sym, 1);
+      abAppend(ab, "\x1b[27m", 5);
+      col++;
+    }
+    else
+    {
+      abAppend(ab, &s[j], n);
+      col += w;
+    }
+    j += n;
+  }
+  if (color)
+    abAppend(ab, "\x1b[39m", 5);
+}
+
+void editorPagerRefresh()
+{
+  struct editorPager *p = E.pager;
+  struct abuf ab = ABUF_INIT;
+  abAppend(&ab, "\x1b[?25l", 6);
+
+  int rows = editorPagerRows();
+  off_t off = p->topoff;
+  for (int y = 0; y < rows; y++)
+  {
+    char pos[32];
+    int plen = snprintf(pos, sizeof(pos), "\x1b[%d;1H", y + 1);
+    abAppend(&ab, pos, plen);
+    if (off < p->size)
+    {
+      editorPagerDrawLine(&ab, off);
+      off = editorPagerNext(off);
+    }
+    else
+      abAppend(&ab, "~", 1);
+    abAppend(&ab, "\x1b[K", 3);
+  }
+
+  char status[80], rstatus[80], total[32];
+  if (p->lines == -1) // not indexed that far yet
+    snprintf(total, sizeof(total), "%ld+", (p->nmarks - 1) * (long)SEX_PAGER_STEP);
+  else
+    snprintf(total, sizeof(total), "%ld", p->lines);
+  int len = snprintf(status, sizeof(status), "%.20s - %s lines (read-only)", p->filename, total);
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%lld%% | %ld/%s",
+                      p->size ? (long long)p->topoff * 100 / p->size : 100LL, p->top + 1, total);
+  char pos[32];
+  int plen = snprintf(pos, sizeof(pos), "\x1b[%d;1H\x1b[7m", rows + 1);
+  abAppend(&ab, pos, plen);
+  if (len > E.termcols)
+    len = E.termcols;
+  abAppend(&ab, status, len);
+  for (; len < E.termcols; len++)
+  {
+    if (E.termcols - len == rlen)
+    {
+      abAppend(&ab, rstatus, rlen);
+      break;
+    }
+    abAppend(&ab, " ", 1);
+  }
+  abAppend(&ab, "\x1b[m", 3);
+  editorDrawMessageBar(&ab);
+
+  abAppend(&ab, "\x1b[H\x1b[?25h", 9);
+  write(STDOUT_FILENO, ab.b, ab.len);
+  abFree(&ab);
+}
+
+// Searches a window at a time from the line below the top of the screen,
+// wrapping around once, counting lines on the way to the match
+void editorPagerFind(int prompt)
+{
+  struct editorPager *p = E.pager;
+  if (prompt)
+  {
+    char *query = editorPromptHistory("Search: %s (ESC to cancel, n for next, C-p/C-n history)", NULL, 1);
+    if (query == NULL)
+      return;
+    free(p->query);
+    p->query = query;
+  }
+  if (p->query == NULL)
+  {
+    editorSetStatusMessage("No previous search");
+    return;
+  }
+
+  size_t qlen = strlen(p->query);
+  long line = p->top + 1;
+  off_t start = editorPagerNext(p->topoff);
+  if (start >= p->size)
+    start = line = 0;
+  off_t off = start, linestart = start;
+  int wrapped = start == 0;
+  while (1)
+  {
+    size_t len;
+    const char *s = editorPagerBytes(off, qlen, &len);
+    if (len < qlen || (wrapped && start > 0 && off >= start))
+    {
+      if (wrapped)
+        break;
+      off = linestart = line = 0;
+      wrapped = 1;
+      continue;
+    }
+    if (editorKeyPending())
+    {
+      editorSetStatusMessage("Search interrupted at line %ld", line + 1);
+      return;
+    }
+
+    const char *m = memmem(s, len, p->query, qlen);
+    size_t scan = m ? (size_t)(m - s) : len - qlen + 1;
+    for (const char *q = s, *nl; (nl = memchr(q, '\n', s + scan - q)); q = nl + 1)
+    {
+      line++;
+      linestart = off + (nl + 1 - s);
+    }
+    if (m)
+    {
+      int col = editorPagerColumn(linestart, off + scan);
+      p->top = line;
+      p->topoff = linestart;
+      p->coloff = col + (int)qlen < E.termcols ? 0 : col - E.termcols / 2;
+      return;
+    }
+    off += scan;
+  }
+  editorSetStatusMessage("Not found: %s", p->query);
+}
+
+// Accepts a line number or a percentage of the file, as editorGotoLine does
+void editorPagerGotoLine()
+{
+  struct editorPager *p = E.pager;
+  char *query = editorPrompt("Go to line: %s (N or N%%, ESC to cancel)", NULL);
+  if (query == NULL)
+    return;
+
+  char *end;
+  long n = strtol(query, &end, 10);
+  if (end == query || (*end && strcmp(end, "%")))
+    editorSetStatusMessage("Not a line number: %s", query);
+  else if (*end != '%')
+    editorPagerScroll(n - 1 - p->top);
+  else if (editorPagerIndexAll())
+    editorPagerScroll((n >= 100 ? p->lines : p->lines * n / 100) - p->top);
+  free(query);
+}
+
+void editorPagerProcessKeypress()
+{
+  struct editorPager *p = E.pager;
+  int c = editorReadKey();
+  switch (c)
+  {
+  case CTRL_KEY('q'):
+  case 'q':
+    editorPagerSessionSave();
+    editorHistorySave();
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    exit(0);
+    break;
+
+  case ARROW_UP:
+  case 'k':
+    editorPagerScroll(-1);
+    break;
+
+  case ARROW_DOWN:
+  case 'j':
+  case '\r':
+    editorPagerScroll(1);
+    break;
+
+  case PAGE_UP:
+  case 'b':
+    editorPagerScroll(-editorPagerRows());
+    break;
+
+  case PAGE_DOWN:
+  case ' ':
+    editorPagerScroll(editorPagerRows());
+    break;
+
+  case HOME_KEY:
+  case 'g':
+    editorPagerScroll(-p->top);
+    break;
+
+  case END_KEY:
+  case 'G':
+    if (editorPagerIndexAll())
+      editorPagerScroll(p->lines);
+    break;
+
+  case ARROW_LEFT:
+    p->coloff = p->coloff > E.termcols / 2 ? p->coloff - E.termcols / 2 : 0;
+    break;
+
+  case ARROW_RIGHT:
+    p->coloff += E.termcols / 2;
+    break;
+
+  case CTRL_KEY('f'):
+  case '/':
+    editorPagerFind(1);
+    break;
+
+  case 'n':
+    editorPagerFind(0);
+    break;
+
+  case CTRL_KEY('g'):
+    editorPagerGotoLine();
+    break;
+  }
 }
 
-void editorRefreshScreen()
-{
-  editorScroll();
+/*** fuzzing ***/
 
-  struct abuf ab = ABUF_INIT;
+#ifdef SEX_FUZZ
 
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
+// Built with -DSEX_FUZZ, `sex --fuzz [seed] [steps]` makes random edits
+// through the row API, checking after each that the rows hold what a plain
+// array of lines does and are highlighted as fuzzHighlight would. Then it
+// times the hot paths, failing if one is over its budget. The budgets are
+// two to four times what they take built with -O2, tight enough that a
+// regression fails and loose enough that noise does not.
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+#define SEX_FUZZ_ROWS 64       // size the random buffer hovers around
+#define SEX_FUZZ_LOAD_NS 2000  // per row appended, as editorOpen does
+#define SEX_FUZZ_HL_NS 20      // per byte highlighted, in one pass or a comment cascade
+#define SEX_FUZZ_KEY_NS 6000   // per key typed into a big file
+#define SEX_FUZZ_MOVE_NS 40    // per row moved up when the first row is deleted
 
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-           (E.rx - E.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
+static unsigned long long fuzzState;
 
-  abAppend(&ab, "\x1b[?25h", 6);
+unsigned int fuzzRand(unsigned int n)
+{
+  fuzzState ^= fuzzState << 13;
+  fuzzState ^= fuzzState >> 7;
+  fuzzState ^= fuzzState << 17;
+  return (unsigned int)(fuzzState >> 32) % n;
+}
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+// Random text made of the pieces highlighting and rendering care about
+int fuzzText(char *buf, int max)
+{
+  static const char *pieces[] = {
+      "/*", "*/", "//", "\"", "'", "\\", " ", "\t", "int", "if", "char", "x", "_a1",
+      "0", "12", ".5", "(", ")", "{", "}", ";", "\xc3\xa9", "\xe4\xb8\xad", "\xff",
+      "rem", "{-", "-}", "--", "`"};
+  int len = 0, n = fuzzRand(9);
+  for (int j = 0; j < n; j++)
+  {
+    const char *p = pieces[fuzzRand(sizeof(pieces) / sizeof(pieces[0]))];
+    int plen = strlen(p);
+    if (len + plen > max)
+      break;
+    memcpy(buf + len, p, plen);
+    len += plen;
+  }
+  return len;
 }
 
-void editorSetStatusMessage(const char *fmt, ...)
+// What the rows should hold
+struct fuzzModel
 {
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-  va_end(ap);
-  E.statusmsg_time = time(NULL);
+  char **lines;
+  int *lens;
+  int n;
+};
+
+// Replaces del lines at at by n copies of lines
+void fuzzSplice(struct fuzzModel *m, int at, int del, char **lines, int *lens, int n)
+{
+  for (int j = at; j < at + del; j++)
+    free(m->lines[j]);
+  m->lines = realloc(m->lines, sizeof(char *) * (m->n + n + 1));
+  m->lens = realloc(m->lens, sizeof(int) * (m->n + n + 1));
+  memmove(&m->lines[at + n], &m->lines[at + del], sizeof(char *) * (m->n - at - del));
+  memmove(&m->lens[at + n], &m->lens[at + del], sizeof(int) * (m->n - at - del));
+  for (int j = 0; j < n; j++)
+  {
+    m->lines[at + j] = malloc(lens[j] + 1);
+    memcpy(m->lines[at + j], lines[j], lens[j]);
+    m->lens[at + j] = lens[j];
+  }
+  m->n += n - del;
 }
 
-/*** input ***/
+// Line y becomes its first a bytes, then s, then what followed byte b
+void fuzzEdit(struct fuzzModel *m, int y, int a, int b, const char *s, int len)
+{
+  char *line = malloc(m->lens[y] - (b - a) + len + 1);
+  memcpy(line, m->lines[y], a);
+  memcpy(line + a, s, len);
+  memcpy(line + a + len, m->lines[y] + b, m->lens[y] - b);
+  int newlen = m->lens[y] - (b - a) + len;
+  fuzzSplice(m, y, 1, &line, &newlen, 1);
+  free(line);
+}
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int))
+void fuzzFree(struct fuzzModel *m)
 {
-  size_t bufsize = 128;
-  char *buf = malloc(bufsize);
+  for (int j = 0; j < m->n; j++)
+    free(m->lines[j]);
+  free(m->lines);
+  free(m->lens);
+  m->lines = NULL;
+  m->lens = NULL;
+  m->n = 0;
+}
 
-  size_t buflen = 0;
-  buf[0] = '\0';
+void fuzzCopy(struct fuzzModel *dst, struct fuzzModel *src)
+{
+  fuzzFree(dst);
+  fuzzSplice(dst, 0, 0, src->lines, src->lens, src->n);
+}
 
-  while (1)
+// The highlighter as kilo had it, a byte at a time straight from the
+// editorSyntax, without the tables and skips of editorUpdateSyntax
+int fuzzHighlight(struct editorSyntax *s, const char *render, int rsize, unsigned char *hl, int in_comment)
+{
+  const char *scs = s->singleline_comment_start;
+  const char *mcs = s->multiline_comment_start, *mce = s->multiline_comment_end;
+  const char *quotes = s->quotes ? s->quotes : "\"'";
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs && mce ? strlen(mcs) : 0, mce_len = mcs && mce ? strlen(mce) : 0;
+  if (mcs_len == 0 || mce_len == 0)
+    mcs_len = mce_len = 0;
+
+  int prev_sep = 1, in_string = 0, i = 0;
+  memset(hl, HL_NORMAL, rsize);
+  while (i < rsize)
   {
-    editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    char c = render[i];
+    unsigned char prev_hl = i > 0 ? hl[i - 1] : HL_NORMAL;
 
-    int c = editorReadKey();
-    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
+    if (scs_len && !in_string && !in_comment && !strncmp(&render[i], scs, scs_len))
     {
-      if (buflen != 0)
-        buf[--buflen] = '\0';
+      memset(&hl[i], HL_COMMENT, rsize - i);
+      break;
     }
-    else if (c == '\x1b')
+
+    if (mcs_len && !in_string)
     {
-      editorSetStatusMessage("");
-      if (callback)
-        callback(buf, c);
-      free(buf);
-      return NULL;
+      if (in_comment)
+      {
+        hl[i] = HL_MLCOMMENT;
+        if (!strncmp(&render[i], mce, mce_len))
+        {
+          memset(&hl[i], HL_MLCOMMENT, mce_len);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+        }
+        else
+          i++;
+        continue;
+      }
+      else if (!strncmp(&render[i], mcs, mcs_len))
+      {
+        memset(&hl[i], HL_MLCOMMENT, mcs_len);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
     }
-    else if (c == '\r')
+
+    if (s->flags & HL_HIGHLIGHT_STRINGS)
     {
-      if (buflen != 0)
+      if (in_string)
       {
-        editorSetStatusMessage("");
-        if (callback)
-          callback(buf, c);
-        return buf;
+        hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 < rsize)
+        {
+          hl[i + 1] = HL_STRING;
+          i += 2;
+          continue;
+        }
+        if (c == in_string)
+          in_string = 0;
+        i++;
+        prev_sep = 1;
+        continue;
+      }
+      else if (c && strchr(quotes, c))
+      {
+        in_string = c;
+        hl[i++] = HL_STRING;
+        continue;
       }
     }
-    else if (!iscntrl(c) && c < 128)
+
+    if ((s->flags & HL_HIGHLIGHT_NUMBERS) &&
+        ((isdigit((unsigned char)c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+         (c == '.' && prev_hl == HL_NUMBER)))
     {
-      if (buflen == bufsize - 1)
+      hl[i++] = HL_NUMBER;
+      prev_sep = 0;
+      continue;
+    }
+
+    if (prev_sep)
+    {
+      int j;
+      for (j = 0; s->keywords[j]; j++)
       {
-        bufsize *= 2;
-        buf = realloc(buf, bufsize);
+        const char *kw = s->keywords[j];
+        int klen = strlen(kw);
+        int kw2 = klen > 0 && kw[klen - 1] == '|';
+        if (kw2)
+          klen--;
+        if (klen > 0 && kw[0] != '|' && !strncmp(&render[i], kw, klen) &&
+            is_separator(render[i + klen]))
+        {
+          memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+          i += klen;
+          break;
+        }
+      }
+      if (s->keywords[j] != NULL)
+      {
+        prev_sep = 0;
+        continue;
       }
-      buf[buflen++] = c;
-      buf[buflen] = '\0';
     }
 
-    if (callback)
-      callback(buf, c);
+    prev_sep = is_separator(c);
+    i++;
   }
+  return in_comment;
 }
 
-void editorMoveCursor(int key)
+void fuzzDump(const char *what, const char *s, int len, int digits)
 {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  fprintf(stderr, "  %-6s ", what);
+  for (int j = 0; j < len; j++)
+    fputc(digits ? '0' + s[j] : (unsigned char)s[j] < ' ' ? '?' : s[j], stderr);
+  fputc('\n', stderr);
+}
 
-  switch (key)
+// Compares every row with the model and with fuzzHighlight
+int fuzzCheck(struct fuzzModel *m, struct editorSyntax *s)
+{
+  struct editorBuffer *b = E.buf;
+  if (b->numrows != m->n)
   {
-  case ARROW_LEFT:
-    if (E.cx != 0)
-    {
-      E.cx--;
-    }
-    else if (E.cy > 0)
-    {
-      E.cy--;
-      E.cx = E.row[E.cy].size;
-    }
-    break;
-  case ARROW_RIGHT:
-    if (row && E.cx < row->size)
-    {
-      E.cx++;
-    }
-    else if (row && E.cx == row->size)
+    fprintf(stderr, "%d rows instead of %d\n", b->numrows, m->n);
+    return 0;
+  }
+  int in_comment = 0;
+  for (int y = 0; y < m->n; y++)
+  {
+    erow *row = &b->row[y];
+    if (row->idx != y || row->size != m->lens[y] || memcmp(row->chars, m->lines[y], row->size) ||
+        row->chars[row->size] != '\0')
     {
-      E.cy++;
-      E.cx = 0;
+      fprintf(stderr, "row %d holds the wrong text\n", y);
+      fuzzDump("got", row->chars, row->size, 0);
+      fuzzDump("want", m->lines[y], m->lens[y], 0);
+      return 0;
     }
-    break;
-  case ARROW_UP:
-    if (E.cy != 0)
+    if (row->rsize < row->size || (row->tabs == 0 && memcmp(row->render, row->chars, row->size)))
     {
-      E.cy--;
+      fprintf(stderr, "row %d renders wrong\n", y);
+      fuzzDump("got", row->render, row->rsize, 0);
+      return 0;
     }
-    break;
-  case ARROW_DOWN:
-    if (E.cy < E.numrows)
+
+    char *hl = malloc(row->rsize + 1);
+    int was = in_comment;
+    in_comment = fuzzHighlight(s, row->render, row->rsize, (unsigned char *)hl, in_comment);
+    if ((row->rsize && memcmp(hl, row->hl, row->rsize)) || row->hlstale || row->hl_open_comment != in_comment)
     {
-      E.cy++;
+      fprintf(stderr, "row %d is highlighted wrong, %s a comment\n", y, was ? "in" : "not in");
+      fuzzDump("text", row->render, row->rsize, 0);
+      fuzzDump("got", (char *)row->hl, row->rsize, 1);
+      fuzzDump("want", hl, row->rsize, 1);
+      free(hl);
+      return 0;
     }
-    break;
-  }
-
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-  int rowlen = row ? row->size : 0;
-  if (E.cx > rowlen)
-  {
-    E.cx = rowlen;
+    free(hl);
   }
+  return 1;
 }
 
-void editorProcessKeypress()
+// One random edit to the buffer and the same to the model
+void fuzzEditOnce(struct fuzzModel *m)
 {
-  static int quit_times = SEX_QUIT_TIMES;
-
-  int c = editorReadKey();
-
-  switch (c)
+  char text[64];
+  int len = fuzzText(text, sizeof(text));
+  int n = E.buf->numrows, y = n ? (int)fuzzRand(n) : 0;
+  erow *row = n ? &E.buf->row[y] : NULL;
+  int op = fuzzRand(7);
+  if (n == 0 || (op == 1 && n < SEX_FUZZ_ROWS / 2))
+    op = 0; // grow back
+  else if (op == 0 && n > SEX_FUZZ_ROWS * 2)
+    op = 1;
+
+  switch (op)
   {
-  case '\r':
-    editorInsertNewline();
+  case 0:
+  {
+    int at = fuzzRand(n + 1);
+    char *p = text;
+    editorInsertRow(at, text, len);
+    fuzzSplice(m, at, 0, &p, &len, 1);
     break;
-
-  case CTRL_KEY('q'):
-    if (E.dirty && quit_times > 0)
-    {
-      editorSetStatusMessage("WARNING!!! File has unsaved changes. "
-                             "Press Ctrl-Q %d more times to quit.",
-                             quit_times);
-      quit_times--;
-      return;
-    }
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    exit(0);
+  }
+  case 1:
+    editorDelRow(y);
+    fuzzSplice(m, y, 1, NULL, NULL, 0);
     break;
-
-  case CTRL_KEY('s'):
-    editorSave();
+  case 2:
+  {
+    int at = fuzzRand(row->size + 1);
+    if (len == 1)
+      editorRowInsertChar(row, at, text[0]);
+    else
+      editorRowInsertString(row, at, text, len);
+    fuzzEdit(m, y, at, at, text, len);
     break;
-
-  case HOME_KEY:
-    E.cx = 0;
+  }
+  case 3:
+  {
+    int at = fuzzRand(row->size + 1), del = fuzzRand(row->size - at + 1);
+    editorRowDelChar(row, at, del);
+    fuzzEdit(m, y, at, at + del, "", 0);
     break;
-
-  case END_KEY:
-    if (E.cy < E.numrows)
-      E.cx = E.row[E.cy].size;
+  }
+  case 4:
+    editorRowAppendString(row, text, len);
+    fuzzEdit(m, y, row->size - len, row->size - len, text, len);
     break;
-
-  case CTRL_KEY('f'):
-    editorFind();
+  case 5:
+  {
+    int at = fuzzRand(n + 1), del = fuzzRand(n - at < 4 ? n - at + 1 : 4), k = fuzzRand(4);
+    char *lines[4], buf[4][64];
+    int lens[4];
+    size_t slens[4];
+    for (int j = 0; j < k; j++)
+    {
+      lines[j] = buf[j];
+      lens[j] = fuzzText(buf[j], sizeof(buf[j]));
+      slens[j] = lens[j];
+    }
+    editorReplaceRows(at, del, lines, slens, NULL, k);
+    fuzzSplice(m, at, del, lines, lens, k);
     break;
-
-  case BACKSPACE:
-  case CTRL_KEY('h'):
-  case DEL_KEY:
-    if (c == DEL_KEY)
-      editorMoveCursor(ARROW_RIGHT);
-    editorDelChar();
+  }
+  case 6: // copy a region and paste it somewhere, sharing whole rows
+  {
+    int fy = fuzzRand(n), ty = fy + fuzzRand(n - fy < 4 ? n - fy : 4);
+    int fx = fuzzRand(m->lens[fy] + 1);
+    int tx = fy == ty ? fx + (int)fuzzRand(m->lens[ty] - fx + 1) : (int)fuzzRand(m->lens[ty] + 1);
+    int cy = fuzzRand(n), cx = fuzzRand(m->lens[cy] + 1);
+    editorCopyRegion(fy, fx, ty, tx);
+    E.cy = cy;
+    E.cx = cx;
+    editorPaste();
+
+    struct fuzzModel clip = {0};
+    fuzzSplice(&clip, 0, 0, &m->lines[fy], &m->lens[fy], ty - fy + 1);
+    fuzzEdit(&clip, clip.n - 1, tx, clip.lens[clip.n - 1], "", 0);
+    fuzzEdit(&clip, 0, 0, fx, "", 0);
+    int last = clip.lens[clip.n - 1];
+    fuzzEdit(&clip, clip.n - 1, last, last, m->lines[cy] + cx, m->lens[cy] - cx);
+    fuzzEdit(&clip, 0, 0, 0, m->lines[cy], cx);
+    fuzzSplice(m, cy, 1, clip.lines, clip.lens, clip.n);
+    fuzzFree(&clip);
     break;
+  }
+  }
+}
 
-  case PAGE_UP:
-  case PAGE_DOWN:
+// Edits a buffer at random, checking it after every step
+int fuzzRun(unsigned long long seed, int steps, struct editorSyntax *s)
+{
+  struct abuf img = ABUF_INIT;
+  unsigned int off = editorCompileSyntax(&img, s);
+  editorSetBuffer(editorNewBuffer());
+  E.buf->syntax = (const struct syntaxTable *)(img.b + off);
+  fuzzState = seed * 0x9E3779B97F4A7C15ULL | 1;
+
+  struct fuzzModel m = {0}, before = {0};
+  int ok = 1;
+  for (int step = 0; step < steps && ok; step++)
   {
-    if (c == PAGE_UP)
+    editorUndoBegin(ARROW_DOWN); // each step is an undo group
+    fuzzCopy(&before, &m);
+    E.replaying = fuzzRand(4) == 0; // highlighting waits, as in a macro
+    for (int k = 1 + fuzzRand(3); k > 0; k--)
+      fuzzEditOnce(&m);
+    E.replaying = 0;
+    editorFlushSyntax();
+    struct editorBuffer *b = E.buf; // a step that journaled nothing has no undo of its own
+    if (fuzzRand(8) == 0 && b->numundo && b->undo[b->numundo - 1].group == E.undogroup)
     {
-      E.cy = E.rowoff;
+      editorUndo();
+      fuzzCopy(&m, &before);
     }
-    else if (c == PAGE_DOWN)
-    {
-      E.cy = E.rowoff + E.screenrows - 1;
-      if (E.cy > E.numrows)
-        E.cy = E.numrows;
-    }
-
-    int times = E.screenrows;
-    while (times--)
-      editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+    ok = fuzzCheck(&m, s);
+    if (!ok)
+      fprintf(stderr, "%s: seed %llu, step %d\n", s->filetype, seed, step);
   }
-  break;
-
-  case ARROW_UP:
-  case ARROW_DOWN:
-  case ARROW_LEFT:
-  case ARROW_RIGHT:
-    editorMoveCursor(c);
-    break;
+  fuzzFree(&m);
+  fuzzFree(&before);
+  return ok;
+}
 
-  case CTRL_KEY('l'):
-  case '\x1b':
-    break;
+// Fails if a hot path took more than budget ns per unit
+int fuzzBudget(const char *what, long long ns, long long units, long long budget)
+{
+  long long per = ns / (units ? units : 1);
+  printf("%-28s %8lld ns %s\n", what, per, per > budget ? "OVER BUDGET" : "ok");
+  return per <= budget;
+}
 
-  default:
-    editorInsertChar(c);
-    break;
+int fuzzTime(struct editorSyntax *s)
+{
+  static char *code[] = {"int main(int argc, char **argv)", "{",
+                         "\tfor (int i = 0; i < 10; i++) // count",
+                         "\t\tprintf(\"%d\\n\", i * 3.5);", "\treturn 0;", "}"};
+  struct abuf img = ABUF_INIT;
+  unsigned int off = editorCompileSyntax(&img, s);
+  editorSetBuffer(editorNewBuffer());
+  E.buf->syntax = (const struct syntaxTable *)(img.b + off);
+  E.journal = 0; // as when loading
+  int rows = 200000, ok = 1;
+
+  long long t = clockNs(), bytes = 0;
+  for (int j = 0; j < rows; j++)
+    editorInsertRow(j, code[j % 6], strlen(code[j % 6]));
+  ok &= fuzzBudget("append a row", clockNs() - t, rows, SEX_FUZZ_LOAD_NS);
+
+  t = clockNs();
+  for (int j = 0; j < rows; j++)
+  {
+    editorUpdateSyntax(&E.buf->row[j]);
+    bytes += E.buf->row[j].rsize;
   }
+  ok &= fuzzBudget("highlight a byte", clockNs() - t, bytes, SEX_FUZZ_HL_NS);
 
-  quit_times = SEX_QUIT_TIMES;
+  // Every row below an opened comment changes, and again once it is closed
+  t = clockNs();
+  editorRowInsertString(&E.buf->row[0], 0, "/*", 2);
+  editorRowDelChar(&E.buf->row[0], 0, 2);
+  ok &= fuzzBudget("comment cascade, a byte", clockNs() - t, bytes * 2, SEX_FUZZ_HL_NS);
+
+  E.cy = rows / 2;
+  E.cx = 0;
+  t = clockNs();
+  for (int j = 0; j < 1000; j++)
+    editorInsertChar('x');
+  ok &= fuzzBudget("type a key", clockNs() - t, 1000, SEX_FUZZ_KEY_NS);
+
+  t = clockNs();
+  for (int j = 0; j < 1000; j++)
+    editorDelRow(0);
+  ok &= fuzzBudget("delete the first row, a row", clockNs() - t, 1000LL * E.buf->numrows, SEX_FUZZ_MOVE_NS);
+  return ok;
+}
+
+int editorFuzz(unsigned long long seed, int steps)
+{
+  // Not wordsafe, as 'r' starts a comment, so highlighting takes its slow paths
+  static char *keywords[] = {"if", "x", "int|", NULL};
+  static struct editorSyntax other = {"fuzz", NULL, keywords, "rem", "{-", "-}",
+                                      HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS, "\"`", NULL};
+  E.inotify_fd = -1;
+  E.stdin_fd = -1;
+  E.replaypos = -1;
+  int ok = fuzzRun(seed, steps, &HLDB[0]) && fuzzRun(seed, steps, &other);
+  if (ok)
+    printf("%d random steps matched\n", steps * 2);
+  ok &= fuzzTime(&HLDB[0]);
+  return ok ? 0 : 1;
 }
 
+#endif
+
 /*** init ***/
 
 void initEditor()
@@ -1287,27 +7199,107 @@ void initEditor()
   E.rx = 0; // row x position
   E.rowoff = 0;
   E.coloff = 0;
-  E.numrows = 0; // nb of rows in file
-  E.row = NULL;  // current row
-  E.dirty = 0;   // bool if row has been modified
-  E.filename = NULL;
+  E.buffers = NULL; // open files, each with its rows and highlight
+  E.numbuffers = 0;
+  E.buf = NULL;
+  editorSetBuffer(editorNewBuffer());
+  E.streams = 0;
+  E.inotify_fd = -1;
   E.statusmsg[0] = '\0'; // message of message bar
   E.statusmsg_time = 0;  // time after displaying status message
-  E.syntax = NULL;
+  E.replaypos = -1;
+  editorLoadSyntaxes();
+  editorHistoryLoad();
 
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) // if error
+  if (getWindowSize(&E.termrows, &E.termcols) == -1) // if error
     die("getWindowSize");
-  E.screenrows -= 2; // bottom rows for status bar
+  E.views = calloc(1, sizeof(struct editorView)); // one view filling the screen
+  E.numviews = 1;
+  E.view = 0;
+  E.views[0].buf = E.buf;
+  E.views[0].rows = E.termrows - 2; // bottom rows for status bar
+  E.views[0].cols = E.termcols;
+  E.repaint = 1;
+  editorLoadView(0);
 }
 
 int main(int argc, char *argv[]) // parameters when calling the program and the file to open
 {
+#ifdef SEX_FUZZ
+  if (argc > 1 && !strcmp(argv[1], "--fuzz")) // needs no terminal, see editorFuzz
+    return editorFuzz(argc > 2 ? strtoull(argv[2], NULL, 10) : 1, argc > 3 ? atoi(argv[3]) : 20000);
+#endif
+  char **files = malloc(sizeof(char *) * argc);
+  long *lines = calloc(argc, sizeof(long));
+  int nfiles = 0;
+  int follow = 0;
+  int viewer = 0;
+  for (int j = 1; j < argc; j++)
+  {
+    char *colon = strrchr(argv[j], ':');
+    if (!strcmp(argv[j], "--trace") && j + 1 < argc)
+      traceOpen(argv[++j]); // records hot path spans, written out on exit
+    else if (!strcmp(argv[j], "-f"))
+      follow = 1; // read-only, keeps appending what is written to the file
+    else if (!strcmp(argv[j], "-R"))
+      viewer = 1; // read-only, for files too big to load, see editorPagerOpen
+    else if (argv[j][0] == '+' && isdigit(argv[j][1]))
+      lines[nfiles] = atol(argv[j] + 1); // +N file, as in vi
+    else if (colon && isdigit(colon[1]) && strspn(colon + 1, "0123456789") == strlen(colon + 1) &&
+             access(argv[j], F_OK) != 0) // file:N, as printed by compilers
+    {
+      *colon = '\0';
+      lines[nfiles] = atol(colon + 1);
+      files[nfiles++] = argv[j];
+    }
+    else
+      files[nfiles++] = argv[j];
+  }
+
+  E.stdin_fd = -1;
   enableRawMode();
   initEditor();
-  if (argc >= 2) // if the program is called with a file to open
+  editorWatchResize();
+  for (int j = 0; j < nfiles; j++)
   {
-    editorOpen(argv[1]); // opens the address of the file in the parameters
+    if (!strcmp(files[j], "-") && E.stdin_fd != -1) // read stdin in the background
+    {
+      if (j > 0)
+        editorSetBuffer(editorNewBuffer());
+      editorStreamStart(E.stdin_fd, 0);
+      E.buf->jump = lines[j];
+      E.stdin_fd = -1;
+    }
+    else if (j == 0 && viewer)
+    {
+      editorPagerOpen(files[j]);
+      if (lines[j])
+        editorPagerScroll(lines[j] - 1 - E.pager->top);
+      break; // the viewer shows one file
+    }
+    else if (j == 0) // if the program is called with a file to open
+    {
+      editorOpen(files[j]); // opens the address of the file in the parameters
+      if (follow)
+        editorFollowStart();
+      if (E.buf->stream_fd != -1) // still decompressing
+        E.buf->jump = lines[j];
+      else if (lines[j])
+        editorJumpToLine(lines[j]);
+    }
+    else // the others load in the background
+    {
+      int count = E.numbuffers;
+      editorLoadBuffer(files[j]);
+      if (E.numbuffers > count)
+        E.buffers[count]->jump = lines[j];
+    }
   }
+  editorSetBuffer(E.buffers[0]);
+  free(files);
+  free(lines);
+  if (E.stdin_fd != -1) // piped input nobody asked for
+    close(E.stdin_fd);
 
   editorSetStatusMessage(
       "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
@@ -1315,7 +7307,10 @@ int main(int argc, char *argv[]) // parameters when calling the program and the
   while (1)
   {
     editorRefreshScreen();
-    editorProcessKeypress();
+    if (E.pager)
+      editorPagerProcessKeypress();
+    else
+      editorProcessKeypress();
   }
 
   return 0;